@@ -1,18 +1,73 @@
 #include <httplib.h>
 
+#include <algorithm>
 #include <argparse/argparse.hpp>
 #include <cstdlib>
+#include <deque>
 #include <exception>
 #include <filesystem>
-#include <fstream>
 #include <iostream>
 #include <stdexcept>
-
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "data_plane.hpp"
+#include "io_engine.hpp"
+#include "metadata_store.hpp"
+#include "partition_cache.hpp"
+#include "rate_limiter.hpp"
+#include "scheduler.hpp"
+#include "shard_map.hpp"
 #include "types.hpp"
 
 using json = nlohmann::json;
 
+// Partitions smaller than this are not worth bypassing the page cache for
+const uint64_t direct_io_threshold = 256 * 1024;
+
+// Partitions this recent may not have their metadata committed yet, so they
+// are never considered orphaned
+const auto orphan_min_age = std::chrono::minutes(10);
+const size_t reconcile_batch_size = 10000;
+
 std::vector<Agent> agents;
+uint16_t self_id = 0;  // Given by the CMMU at registration
+bool redirect_reads = false;
+DataPlaneClientPool data_clients;
+
+// Scheduling class of each route, the others (stats) are never queued
+const std::unordered_map<std::string, Priority> route_priorities = {
+    {"/read", Priority::Interactive},
+    {"/mkdir", Priority::Interactive},
+    {"/readdir", Priority::Interactive},
+    {"/rename", Priority::Interactive},
+    {"/internal/read", Priority::Peer},
+    {"/write", Priority::Bulk},
+    {"/internal/write", Priority::Peer},
+    {"/internal/fetch", Priority::Background},
+    {"/internal/delete", Priority::Background},
+};
+
+// Header asking for a lower class than the route's, e.g. the source read of a
+// rebalancing move must not take the slots of client reads
+const std::string priority_header = "X-DFS-Priority";
+
+// Slot of the request handled by this thread, held from routing until its
+// response is written
+thread_local std::shared_ptr<RequestScheduler::Ticket> current_ticket;
+
+// Every CMMU shard and a connection to each of them, in the same order. The
+// map is empty and there is a single connection when the CMMU is not sharded.
+ShardMap shard_map;
+std::deque<httplib::Client> shards;
+
+/**
+ * Get the CMMU shard owning a path
+ */
+httplib::Client& cmmu_for(const std::string& filepath) {
+  return shards[shard_map.owner(filepath)];
+}
 
 std::vector<Agent> get_agents(httplib::Client& cmmu) {
   auto result = cmmu.Post("/agents");
@@ -32,13 +87,226 @@ std::vector<Agent> get_agents(httplib::Client& cmmu) {
     }
 
     for (auto& j_agent : j_body) {
-      ret.push_back({j_agent["id"], j_agent["address"], j_agent["port"]});
+      ret.push_back({j_agent["id"], j_agent["address"], j_agent["port"],
+                     j_agent.value("data_port", (uint16_t)0)});
     }
 
     return ret;
   }
 }
 
+/**
+ * Forward a request from the CLI/user as is to the CMMU shard owning the path
+ * in the `key` field of the body
+ */
+void forward_to_cmmu(const std::string& route, const std::string& key,
+                     const httplib::Request& req, httplib::Response& res) {
+  std::string filepath;
+  try {
+    filepath = json::parse(req.body).at(key);
+  } catch (const std::exception& e) {
+    res.set_content(e.what(), "text/plain");
+    res.status = httplib::StatusCode::BadRequest_400;
+    return;
+  }
+
+  auto result = cmmu_for(filepath).Post(route, req.body, "application/json");
+  if (!result) {
+    std::cerr << "Error while sending to CMMU: " << result.error()
+              << std::endl;
+    res.set_content(httplib::to_string(result.error()), "text/plain");
+    res.status = httplib::StatusCode::InternalServerError_500;
+    return;
+  }
+
+  res.set_content(result->body, result->get_header_value("Content-Type"));
+  res.status = result->status;
+}
+
+/**
+ * List the root directory, whose entries are split across every CMMU shard
+ *
+ * Every shard returns its next page after the cursor, the pages are merged
+ * and cut to the limit.
+ */
+void read_root_directory(const json& j_body, httplib::Response& res) {
+  uint64_t limit = j_body.value("limit", (uint64_t)1000);
+  json entries = json::array();
+  bool more = false;
+
+  for (auto& shard : shards) {
+    auto result = shard.Post("/readdir", j_body.dump(), "application/json");
+    if (!result || result->status != 200) {
+      res.set_content(result ? result->body : "Failed to reach CMMU shard",
+                      "text/plain");
+      res.status = result ? result->status
+                          : httplib::StatusCode::InternalServerError_500;
+      return;
+    }
+
+    try {
+      json page = json::parse(result->body);
+      for (auto& entry : page.at("entries")) entries.push_back(entry);
+      more = more || page.at("cursor") != "";
+    } catch (const std::exception& e) {
+      res.set_content(e.what(), "text/plain");
+      res.status = httplib::StatusCode::InternalServerError_500;
+      return;
+    }
+  }
+
+  std::sort(entries.begin(), entries.end(),
+            [](const json& a, const json& b) { return a["name"] < b["name"]; });
+  if (entries.size() > limit) {
+    entries.erase(entries.begin() + limit, entries.end());
+    more = true;
+  }
+
+  json page = json::object();
+  page["entries"] = entries;
+  page["cursor"] = more ? entries.back()["name"] : "";
+  res.set_content(page.dump(), "application/json");
+  res.status = httplib::StatusCode::OK_200;
+}
+
+/**
+ * Send the client to the agent holding most of the file, if it is not us
+ *
+ * Returns true if the response is a redirect. Redirected requests carry
+ * `redirected=1` so they are served wherever they land.
+ */
+bool redirect_read(const json& j_metadata, const std::string& filepath,
+                   const httplib::Request& req, httplib::Response& res) {
+  if (!redirect_reads || req.has_param("redirected")) return false;
+
+  auto preferred = j_metadata.value("preferred_agent", json());
+  if (preferred.is_null() || preferred.at("id") == self_id) return false;
+
+  std::string url = "http://" + preferred.at("address").get<std::string>() +
+                    ":" + std::to_string(preferred.at("port").get<uint>()) +
+                    "/read?redirected=1";
+  if (req.method == "GET") {
+    url += "&filepath=" + httplib::detail::encode_query_param(filepath);
+  }
+
+  // 307 so that POST requests keep their method and body
+  res.set_redirect(url, httplib::StatusCode::TemporaryRedirect_307);
+  return true;
+}
+
+/**
+ * Stream a partition from the data plane of another agent into `sink`
+ */
+bool read_from_data_plane(const Agent& agent, const std::string& filepath,
+                          PartitionCache& cache, httplib::DataSink& sink) {
+  try {
+    auto data = std::make_shared<const std::string>(
+        data_clients.get(agent.m_address, agent.m_data_port).read(filepath));
+    sink.write(data->data(), data->size());
+    cache.put(filepath, std::move(data));
+    return true;
+  } catch (const std::exception& e) {
+    std::cerr << "Error while reading partition " << filepath << ": "
+              << e.what() << std::endl;
+    return false;
+  }
+}
+
+/**
+ * Path of the partition `name` in `datapath`
+ *
+ * Throws std::invalid_argument unless `name` is a partition UUID, so no
+ * request can reach a file outside the data directory.
+ */
+std::filesystem::path partition_path(const std::filesystem::path& datapath,
+                                     const std::string& name) {
+  PartitionId::from_string(name);
+  return datapath / name;
+}
+
+/**
+ * Add to `live` the partitions in `names` referenced by any CMMU shard
+ *
+ * Returns false if a shard could not be asked, nothing can be deleted then
+ */
+bool find_referenced(const std::vector<std::string>& names,
+                     std::unordered_set<std::string>& live) {
+  json j_body = json::object();
+  j_body["agent_id"] = self_id;
+  j_body["filepaths"] = names;
+  std::string body = j_body.dump();
+
+  for (auto& shard : shards) {
+    auto result = shard.Post("/internal/referenced", body, "application/json");
+    if (!result || result->status != 200) return false;
+
+    try {
+      json j_res = json::parse(result->body);
+      for (auto& name : j_res.at("referenced")) {
+        live.insert(name.get<std::string>());
+      }
+    } catch (const std::exception& e) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * Delete the partitions on disk that no CMMU shard references anymore
+ *
+ * Catches what the CMMU garbage collector missed, e.g. partitions of a failed
+ * write or deletions sent while this agent was down.
+ */
+void reconcile(const std::filesystem::path& datapath, RateLimiter& limiter) {
+  auto now = std::filesystem::file_time_type::clock::now();
+  std::vector<std::string> candidates;
+  uint64_t deleted = 0;
+
+  auto flush = [&]() {
+    std::unordered_set<std::string> live;
+    if (!find_referenced(candidates, live)) {
+      std::cerr << "Reconcile: failed to reach the CMMU, skipping "
+                << candidates.size() << " partitions" << std::endl;
+      candidates.clear();
+      return;
+    }
+
+    for (auto& name : candidates) {
+      if (live.contains(name)) continue;
+      limiter.acquire(1);
+      std::error_code ec;
+      if (std::filesystem::remove(datapath / name, ec)) deleted++;
+    }
+    candidates.clear();
+  };
+
+  std::error_code ec;
+  for (auto& entry : std::filesystem::directory_iterator(datapath, ec)) {
+    std::error_code entry_ec;
+    if (!entry.is_regular_file(entry_ec)) continue;
+    auto mtime = entry.last_write_time(entry_ec);
+    if (entry_ec || now - mtime < orphan_min_age) continue;
+
+    auto name = entry.path().filename().string();
+    try {
+      PartitionId::from_string(name);
+    } catch (const std::invalid_argument& e) {
+      continue;  // Not a partition
+    }
+
+    candidates.push_back(std::move(name));
+    if (candidates.size() >= reconcile_batch_size) flush();
+  }
+  if (!candidates.empty()) flush();
+
+  if (deleted > 0) {
+    std::cerr << "Reconcile: deleted " << deleted << " orphaned partitions"
+              << std::endl;
+  }
+}
+
 int main(int argc, char* argv[]) {
   argparse::ArgumentParser program("Agent");
 
@@ -69,6 +337,93 @@ int main(int argc, char* argv[]) {
       .default_value("/tmp/dfs")
       .nargs(1);
 
+  program.add_argument("-c", "--cache-size")
+      .help("Memory budget of the partition cache in MB, 0 disables it. The "
+            "cache is split in 16 shards, partitions larger than 1/16 of it "
+            "are never cached")
+      .default_value((uint)256)
+      .scan<'u', uint>()
+      .nargs(1);
+
+  program.add_argument("-q", "--queue-depth")
+      .help("Max number of partition reads/writes in flight on the disk")
+      .default_value((uint)64)
+      .scan<'u', uint>()
+      .nargs(1);
+
+  program.add_argument("--direct-io")
+      .help("Bypass the page cache (O_DIRECT) for large partitions")
+      .flag();
+
+  program.add_argument("--data-port")
+      .help("Port of the binary data plane for partitions, 0 for any free "
+            "port (it is sent to the CMMU at registration)")
+      .default_value((uint)0)
+      .scan<'u', uint>()
+      .nargs(1);
+
+  program.add_argument("--max-partition-size")
+      .help("Largest partition accepted over the data plane, in bytes, must be "
+            "at least the CMMU part size")
+      .default_value((uint)(64 * 1024 * 1024))
+      .scan<'u', uint>()
+      .nargs(1);
+
+  program.add_argument("--redirect-reads")
+      .help("Redirect reads to the agent holding most of the file")
+      .flag();
+
+  program.add_argument("--max-requests")
+      .help("Max number of requests handled at once")
+      .default_value((uint)32)
+      .scan<'u', uint>()
+      .nargs(1);
+
+  program.add_argument("--bulk-requests")
+      .help("Max number of uploads handled at once")
+      .default_value((uint)8)
+      .scan<'u', uint>()
+      .nargs(1);
+
+  program.add_argument("--background-requests")
+      .help("Max number of background requests (rebalancing, deletion) "
+            "handled at once")
+      .default_value((uint)2)
+      .scan<'u', uint>()
+      .nargs(1);
+
+  program.add_argument("--peer-requests")
+      .help("Max number of partition transfers from the CMMU and other "
+            "agents handled at once, on top of --max-requests")
+      .default_value((uint)16)
+      .scan<'u', uint>()
+      .nargs(1);
+
+  program.add_argument("--max-queued")
+      .help("Max number of requests waiting per class before new ones get "
+            "503")
+      .default_value((uint)256)
+      .scan<'u', uint>()
+      .nargs(1);
+
+  program.add_argument("--max-queue-delay")
+      .help("Max milliseconds a request waits before it gets 503")
+      .default_value((uint)2000)
+      .scan<'u', uint>()
+      .nargs(1);
+
+  program.add_argument("--reconcile-interval")
+      .help("Seconds between scans for orphaned partitions, 0 disables them")
+      .default_value((uint)3600)
+      .scan<'u', uint>()
+      .nargs(1);
+
+  program.add_argument("--gc-rate")
+      .help("Max orphaned partitions deleted per second, 0 for no limit")
+      .default_value((uint)100)
+      .scan<'u', uint>()
+      .nargs(1);
+
   try {
     program.parse_args(argc, argv);
   } catch (const std::exception& e) {
@@ -99,39 +454,174 @@ int main(int argc, char* argv[]) {
   }
 
   std::filesystem::path datapath(program.get("-d"));
+  PartitionCache cache((uint64_t)program.get<uint>("-c") * 1024 * 1024);
+  std::unique_ptr<IOEngine> io;
+  try {
+    io = make_io_engine(program.get<uint>("-q"),
+                        program.get<bool>("--direct-io"), direct_io_threshold);
+  } catch (const std::invalid_argument& e) {
+    std::cerr << "Invalid --queue-depth: " << e.what() << std::endl;
+    return 1;
+  }
+  std::cerr << "Using " << io->name() << " for disk I/O" << std::endl;
+  redirect_reads = program.get<bool>("--redirect-reads");
+
+  /**
+   * Read a partition stored on this agent, through the cache
+   */
+  auto read_local = [&datapath, &cache,
+                     &io](const std::string& filepath) -> PartitionCache::Data {
+    auto path = partition_path(datapath, filepath);
+    if (auto data = cache.get(filepath)) return data;
+
+    auto data = std::make_shared<const std::string>(io->read_file(path));
+    cache.put(filepath, data);
+    return data;
+  };
 
   // TODO: Check if the datapath exist and valid
 
+  // A class without slots would accept connections and never serve them
+  for (auto flag : {"--max-requests", "--bulk-requests",
+                    "--background-requests", "--peer-requests"}) {
+    if (program.get<uint>(flag) < 1) {
+      std::cerr << flag << " must be at least 1" << std::endl;
+      return 1;
+    }
+  }
+
+  uint max_requests = program.get<uint>("--max-requests");
+  uint peer_requests = program.get<uint>("--peer-requests");
+
+  // Waiting requests hold a connection thread. Past the running ones, half of
+  // the threads may wait in the classes below Interactive and the other half
+  // is kept for reads.
+  size_t connection_threads = (max_requests + peer_requests) * 4;
+  size_t max_queued_lower =
+      (connection_threads - max_requests - peer_requests) / 2;
+
+  RequestScheduler scheduler(
+      max_requests,
+      {max_requests, program.get<uint>("--bulk-requests"),
+       program.get<uint>("--background-requests"), peer_requests},
+      program.get<uint>("--max-queued"), max_queued_lower,
+      std::chrono::milliseconds(program.get<uint>("--max-queue-delay")));
+
+  /**
+   * Partition writes and reads from the CMMU and other agents
+   */
+  uint max_partition_size = program.get<uint>("--max-partition-size");
+  data_clients.set_max_data(max_partition_size);
+  DataPlaneServer data_server(
+      [&datapath, &io, &cache, &scheduler](
+          DataFrame& req, DataPlaneServer::Respond respond) {
+        // Never park one of the few data plane workers, shed right away
+        auto ticket = scheduler.try_admit(Priority::Peer);
+        if (!ticket) {
+          throw std::system_error(
+              std::make_error_code(std::errc::resource_unavailable_try_again),
+              "Agent is overloaded");
+        }
+
+        // The slot is held until the disk is done, which bounds the
+        // transfers in flight
+        auto path = partition_path(datapath, req.name);
+        switch (req.op) {
+          case DataOp::Write:
+            io->write_file_async(
+                path, std::make_shared<const std::string>(std::move(req.data)),
+                [ticket, respond](std::exception_ptr error) {
+                  respond(nullptr, error);
+                });
+            return;
+          case DataOp::Read:
+            if (auto data = cache.get(req.name)) return respond(data, nullptr);
+            io->read_file_async(
+                path, [ticket, respond, &cache, name = req.name](
+                          std::string content, std::exception_ptr error) {
+                  if (error) return respond(nullptr, error);
+                  auto data =
+                      std::make_shared<const std::string>(std::move(content));
+                  cache.put(name, data);
+                  respond(data, nullptr);
+                });
+            return;
+        }
+        throw std::invalid_argument("Unknown data plane operation");
+      },
+      8, max_partition_size);
+
   httplib::Server server;
 
+  ConnectionTaskQueue* connections = nullptr;
+  server.new_task_queue = [&connections, connection_threads]() {
+    connections =
+        new ConnectionTaskQueue(connection_threads, connection_threads * 4);
+    return connections;
+  };
+
+  server.set_pre_routing_handler([&scheduler](const httplib::Request& req,
+                                              httplib::Response& res) {
+    auto route = route_priorities.find(req.path);
+    if (route == route_priorities.end()) {
+      return httplib::Server::HandlerResponse::Unhandled;
+    }
+
+    auto priority = route->second;
+    if (req.get_header_value(priority_header) == "background") {
+      priority = Priority::Background;
+    }
+
+    current_ticket = scheduler.admit(priority);
+    if (!current_ticket) {
+      res.set_header("Retry-After", "1");
+      res.set_content("Agent is overloaded", "text/plain");
+      res.status = httplib::StatusCode::ServiceUnavailable_503;
+      return httplib::Server::HandlerResponse::Handled;
+    }
+    return httplib::Server::HandlerResponse::Unhandled;
+  });
+
+  server.set_post_routing_handler(
+      [](const httplib::Request& req, httplib::Response& res) {
+        if (!current_ticket) return;
+
+        // Streamed bodies are produced after this, keep the slot until then
+        if (res.content_provider_) {
+          auto releaser = std::move(res.content_provider_resource_releaser_);
+          res.content_provider_resource_releaser_ =
+              [ticket = current_ticket, releaser](bool success) {
+                if (releaser) releaser(success);
+              };
+        }
+        current_ticket.reset();
+      });
+
   /**
    * NOTE: Should only be called by CMMU
    *
    * Store a partition on the current node
    */
-  server.Post("/internal/write", [&datapath](const httplib::Request& req,
-                                             httplib::Response& res) {
+  server.Post("/internal/write", [&datapath, &io](const httplib::Request& req,
+                                                  httplib::Response& res) {
     if (req.files.size() != 1) {
       res.set_content("This route takes exactly 1 file", "text/plain");
       res.status = httplib::StatusCode::BadRequest_400;
       return;
     }
 
-    auto file = req.files.begin()->second;
-    auto path = datapath / file.filename;
-
+    const auto& file = req.files.begin()->second;
+    std::filesystem::path path;
     try {
-      std::ofstream f(path, std::ios::binary);
-      if (!f) {
-        std::cerr << "File open failed" << std::endl;
-
-        res.set_content("Failed", "text/plain");
-        res.status = httplib::StatusCode::InternalServerError_500;
-        return;
-      }
+      path = partition_path(datapath, file.filename);
+    } catch (const std::invalid_argument& e) {
+      res.set_content(e.what(), "text/plain");
+      res.status = httplib::StatusCode::BadRequest_400;
+      return;
+    }
 
-      f.write(file.content.data(), file.content.size());
-      f.close();
+    try {
+      io->write_file(path, file.content);
     } catch (const std::exception& e) {
       std::cerr << "Error while writing content to file: " << e.what()
                 << std::endl;
@@ -147,7 +637,7 @@ int main(int argc, char* argv[]) {
   /**
    * Called by CLI/user to write a file to our system
    */
-  server.Post("/write", [&cmmu](const httplib::Request& req,
+  server.Post("/write", [](const httplib::Request& req,
                                 httplib::Response& res) {
     // name, content, filename, content-type
     auto size = req.files.size();
@@ -161,10 +651,10 @@ int main(int argc, char* argv[]) {
 
     httplib::MultipartFormDataItems item = {req.files.begin()->second};
 
-    auto result = cmmu.Post("/write", item);
+    auto result = cmmu_for(item[0].name).Post("/write", item);
     if (result) {
       res.set_content(result->body, result->get_header_value("Content-Type"));
-      res.status = httplib::StatusCode::Created_201;
+      res.status = result->status;
     } else {
       std::cerr << "Error while sending to CMMU: " << result.error()
                 << std::endl;
@@ -173,8 +663,8 @@ int main(int argc, char* argv[]) {
     }
   });
 
-  server.Post("/internal/read", [&datapath](const httplib::Request& req,
-                                            httplib::Response& res) {
+  server.Post("/internal/read", [&read_local](const httplib::Request& req,
+                                              httplib::Response& res) {
     json j_body;
     std::string filepath;
     try {
@@ -194,41 +684,171 @@ int main(int argc, char* argv[]) {
     }
 
     filepath = j_body["filepath"];
-    auto path = datapath / filepath;
 
     try {
-      std::ifstream f(path, std::ios::binary);
-      if (!f) {
+      // Stream straight from the shared buffer instead of copying it
+      auto data = read_local(filepath);
+      res.set_content_provider(
+          data->size(), "application/octet-stream",
+          [data](size_t offset, size_t length, httplib::DataSink& sink) {
+            return sink.write(data->data() + offset, length);
+          });
+      res.status = httplib::StatusCode::OK_200;
+    } catch (const std::invalid_argument& e) {
+      res.set_content(e.what(), "text/plain");
+      res.status = httplib::StatusCode::BadRequest_400;
+    } catch (const std::system_error& e) {
+      if (e.code() == std::errc::no_such_file_or_directory) {
         res.set_content("File/partition does not exist", "text/plain");
         res.status = httplib::StatusCode::NotFound_404;
-      } else {
-        res.set_chunked_content_provider(
-            "application/octet-stream",
-            [path](size_t offset, httplib::DataSink& sink) {  // Read file
-              std::ifstream f(path, std::ios::binary);
-              if (!f) {
-                sink.done();
-                return false;
-              }
+        return;
+      }
+      std::cerr << "Error while reading file: " << e.what() << std::endl;
+      res.set_content(e.what(), "text/plain");
+      res.status = httplib::StatusCode::InternalServerError_500;
+    } catch (const std::exception& e) {
+      std::cerr << "Error while reading file: " << e.what() << std::endl;
+      res.set_content(e.what(), "text/plain");
+      res.status = httplib::StatusCode::InternalServerError_500;
+    }
+  });
 
-              char buffer[1024];
-              memset(buffer, 0, sizeof buffer);
-              while (!f.eof()) {
-                f.read(buffer, sizeof buffer);
-                sink.write(buffer, f.gcount());
-              }
+  /**
+   * NOTE: Should only be called by CMMU
+   *
+   * Copy a partition from another agent to the current node
+   *
+   * body: {
+   *   filepath: string,
+   *   address: string (address of the agent holding the partition),
+   *   port: int
+   * }
+   */
+  server.Post("/internal/fetch", [&datapath, &io](const httplib::Request& req,
+                                                  httplib::Response& res) {
+    json j_body;
+    try {
+      j_body = json::parse(req.body);
+    } catch (const std::exception& e) {
+      std::cerr << "Error while parsing JSON: " << e.what() << std::endl;
+      res.set_content(e.what(), "text/plain");
+      res.status = httplib::StatusCode::BadRequest_400;
+      return;
+    }
 
-              f.close();
+    // Validating request
+    if (!j_body.contains("filepath") || !j_body.contains("address") ||
+        !j_body.contains("port")) {
+      res.set_content("Request needs filepath, address and port",
+                      "text/plain");
+      res.status = httplib::StatusCode::BadRequest_400;
+      return;
+    }
 
-              sink.done();
-              return true;
-            });
-      }
+    std::string filepath = j_body["filepath"];
+    std::filesystem::path path;
+    try {
+      path = partition_path(datapath, filepath);
+    } catch (const std::invalid_argument& e) {
+      res.set_content(e.what(), "text/plain");
+      res.status = httplib::StatusCode::BadRequest_400;
+      return;
+    }
+
+    json j_read = json::object();
+    j_read["filepath"] = filepath;
+
+    httplib::Client source(j_body["address"].get<std::string>(),
+                           j_body["port"].get<uint16_t>());
+    httplib::Headers headers = {{priority_header, "background"}};
+    auto result = source.Post("/internal/read", headers, j_read.dump(),
+                              "application/json");
+    if (!result || result->status != 200) {
+      res.set_content("Failed to read partition from source", "text/plain");
+      res.status = httplib::StatusCode::InternalServerError_500;
+      return;
+    }
+
+    try {
+      io->write_file(path, result->body);
     } catch (const std::exception& e) {
-      std::cerr << "Error while reading file: " << e.what() << std::endl;
+      std::cerr << "Error while writing content to file: " << e.what()
+                << std::endl;
       res.set_content(e.what(), "text/plain");
       res.status = httplib::StatusCode::InternalServerError_500;
+      return;
+    }
+
+    res.set_content("Received", "text/plain");
+    res.status = httplib::StatusCode::Created_201;
+  });
+
+  /**
+   * NOTE: Should only be called by CMMU
+   *
+   * Delete partitions that are no longer referenced
+   *
+   * body: {
+   *   filepaths: [string]
+   * }
+   */
+  server.Post("/internal/delete", [&datapath](const httplib::Request& req,
+                                              httplib::Response& res) {
+    json j_body;
+    try {
+      j_body = json::parse(req.body);
+    } catch (const std::exception& e) {
+      std::cerr << "Error while parsing JSON: " << e.what() << std::endl;
+      res.set_content(e.what(), "text/plain");
+      res.status = httplib::StatusCode::BadRequest_400;
+      return;
+    }
+
+    if (!j_body.contains("filepaths") || !j_body["filepaths"].is_array()) {
+      res.set_content("Request does not contain filepaths", "text/plain");
+      res.status = httplib::StatusCode::BadRequest_400;
+      return;
     }
+
+    uint64_t deleted = 0;
+    for (auto& filepath : j_body["filepaths"]) {
+      std::filesystem::path path;
+      try {
+        path = partition_path(datapath, filepath.get<std::string>());
+      } catch (const std::exception& e) {
+        continue;  // Not a partition, or not a string
+      }
+
+      std::error_code ec;
+      if (std::filesystem::remove(path, ec)) deleted++;
+    }
+
+    json j_res = json::object();
+    j_res["deleted"] = deleted;
+    res.set_content(j_res.dump(), "application/json");
+    res.status = httplib::StatusCode::OK_200;
+  });
+
+  /**
+   * Get the hit rate of the partition cache
+   */
+  server.Get("/internal/cache",
+             [&cache](const httplib::Request& req, httplib::Response& res) {
+               res.set_content(cache.stats().dump(), "application/json");
+               res.status = httplib::StatusCode::OK_200;
+             });
+
+  /**
+   * Get the load and queueing delays of every request class
+   */
+  server.Get("/internal/scheduler", [&scheduler, &connections](
+                                        const httplib::Request& req,
+                                        httplib::Response& res) {
+    json j_res = json::object();
+    j_res["requests"] = scheduler.stats();
+    j_res["connections"] = connections ? connections->stats() : json();
+    res.set_content(j_res.dump(), "application/json");
+    res.status = httplib::StatusCode::OK_200;
   });
 
   /**
@@ -238,8 +858,8 @@ int main(int argc, char* argv[]) {
    *   filepath: string
    * }
    */
-  server.Post("/read", [&datapath, &cmmu](const httplib::Request& req,
-                                          httplib::Response& res) {
+  server.Post("/read", [&cache, &read_local](const httplib::Request& req,
+                                             httplib::Response& res) {
     json j_body;
     std::string filepath;
     try {
@@ -259,6 +879,7 @@ int main(int argc, char* argv[]) {
     }
 
     filepath = j_body["filepath"];
+    auto& cmmu = cmmu_for(filepath);
 
     // Get file metadata
     {
@@ -299,6 +920,15 @@ int main(int argc, char* argv[]) {
         return;
       }
 
+      if (redirect_read(j_metadata, filepath, req, res)) return;
+
+      // Inline files are served straight from the metadata
+      if (metadata.is_inline) {
+        res.set_content(metadata.inline_data, "application/octet-stream");
+        res.status = httplib::StatusCode::OK_200;
+        return;
+      }
+
       // Getting all the agents from the CMMU
       try {
         agents = get_agents(cmmu);
@@ -312,13 +942,39 @@ int main(int argc, char* argv[]) {
       // TODO: Call to agents to get partitions
       res.set_chunked_content_provider(
           "application/octet-stream",
-          [metadata](size_t offset, httplib::DataSink& sink) {
+          [metadata, &cache, &read_local](size_t offset,
+                                          httplib::DataSink& sink) {
             for (auto& part : metadata.partitions) {
+              if (part.agent_id == self_id) {  // No need to go over HTTP
+                try {
+                  auto data = read_local(part.filepath);
+                  sink.write(data->data(), data->size());
+                } catch (const std::exception& e) {
+                  std::cerr << "Error while reading partition: " << e.what()
+                            << std::endl;
+                  return false;
+                }
+                continue;
+              }
+
+              if (auto data = cache.get(part.filepath)) {
+                sink.write(data->data(), data->size());
+                continue;
+              }
+
               json j_body = json::object();
               j_body["filepath"] = part.filepath;
               std::cerr << "Getting data for part " << part.part_id
                         << std::endl;
               for (auto& agent : agents) {
+                if (agent.m_id == part.agent_id && agent.m_data_port != 0) {
+                  if (!read_from_data_plane(agent, part.filepath, cache,
+                                            sink)) {
+                    return false;
+                  }
+                  break;
+                }
+
                 if (agent.m_id == part.agent_id) {
                   std::cerr << "Sending req to " << agent.m_address
                             << std::endl;
@@ -332,6 +988,10 @@ int main(int argc, char* argv[]) {
                   std::cerr << "Part " << part.part_id << ":" << std::endl;
                   std::cerr << result->body << std::endl;
                   sink.write(result->body.data(), result->body.size());
+                  if (result->status == 200) {
+                    cache.put(part.filepath, std::make_shared<std::string>(
+                                                 std::move(result->body)));
+                  }
                 }
               }
             }
@@ -349,8 +1009,8 @@ int main(int argc, char* argv[]) {
    *   filepath: string
    * }
    */
-  server.Get("/read", [&datapath, &cmmu](const httplib::Request& req,
-                                         httplib::Response& res) {
+  server.Get("/read", [&cache, &read_local](const httplib::Request& req,
+                                            httplib::Response& res) {
     std::string filepath;
     FileMetadata metadata;
 
@@ -361,6 +1021,7 @@ int main(int argc, char* argv[]) {
     }
 
     filepath = req.get_param_value("filepath");
+    auto& cmmu = cmmu_for(filepath);
 
     {  // NOTE: Get file metadata
       json j_body = json::object();
@@ -398,6 +1059,15 @@ int main(int argc, char* argv[]) {
         res.status = httplib::StatusCode::InternalServerError_500;
         return;
       }
+
+      if (redirect_read(j_metadata, filepath, req, res)) return;
+    }
+
+    // Inline files are served straight from the metadata
+    if (metadata.is_inline) {
+      res.set_content(metadata.inline_data, "application/octet-stream");
+      res.status = httplib::StatusCode::OK_200;
+      return;
     }
 
     // Getting all the agents from the CMMU
@@ -414,11 +1084,36 @@ int main(int argc, char* argv[]) {
 
     res.set_chunked_content_provider(
         "application/octet-stream",
-        [metadata](size_t offset, httplib::DataSink& sink) {
+        [metadata, &cache, &read_local](size_t offset,
+                                        httplib::DataSink& sink) {
           for (auto& part : metadata.partitions) {
+            if (part.agent_id == self_id) {  // No need to go over HTTP
+              try {
+                auto data = read_local(part.filepath);
+                sink.write(data->data(), data->size());
+              } catch (const std::exception& e) {
+                std::cerr << "Error while reading partition: " << e.what()
+                          << std::endl;
+                return false;
+              }
+              continue;
+            }
+
+            if (auto data = cache.get(part.filepath)) {
+              sink.write(data->data(), data->size());
+              continue;
+            }
+
             json j_body = json::object();
             j_body["filepath"] = part.filepath;
             for (auto& agent : agents) {
+              if (agent.m_id == part.agent_id && agent.m_data_port != 0) {
+                if (!read_from_data_plane(agent, part.filepath, cache, sink)) {
+                  return false;
+                }
+                break;
+              }
+
               // NOTE: Call to agents to get partitions
               if (agent.m_id == part.agent_id) {
                 auto result = agent.m_conn.Post("/internal/read", j_body.dump(),
@@ -428,6 +1123,10 @@ int main(int argc, char* argv[]) {
                 }
 
                 sink.write(result->body.data(), result->body.size());
+                if (result->status == 200) {
+                  cache.put(part.filepath, std::make_shared<std::string>(
+                                               std::move(result->body)));
+                }
                 break;
               }
             }
@@ -438,10 +1137,59 @@ int main(int argc, char* argv[]) {
         });
   });
 
+  /**
+   * Called by CLI/user to manage directories, see the CMMU for the bodies
+   */
+  server.Post("/mkdir",
+              [](const httplib::Request& req, httplib::Response& res) {
+                forward_to_cmmu("/mkdir", "filepath", req, res);
+              });
+
+  server.Post("/readdir", [](const httplib::Request& req,
+                             httplib::Response& res) {
+    json j_body;
+    try {
+      j_body = json::parse(req.body);
+    } catch (const std::exception& e) {
+      res.set_content(e.what(), "text/plain");
+      res.status = httplib::StatusCode::BadRequest_400;
+      return;
+    }
+
+    if (shards.size() > 1 &&
+        ShardMap::is_root(j_body.value("filepath", ""))) {
+      read_root_directory(j_body, res);
+    } else {
+      forward_to_cmmu("/readdir", "filepath", req, res);
+    }
+  });
+
+  server.Post("/rename",
+              [](const httplib::Request& req, httplib::Response& res) {
+                forward_to_cmmu("/rename", "from", req, res);
+              });
+
+  int data_port = program.get<uint>("--data-port");
+  if (data_port == 0) {
+    data_port = data_server.bind_to_any_port(host);
+  } else if (!data_server.bind_to_port(host, data_port)) {
+    data_port = -1;
+  }
+  if (data_port < 0) {
+    std::cerr << "Failed to listen for the data plane at " << host << ":"
+              << program.get<uint>("--data-port") << std::endl;
+    return 1;
+  }
+  std::cerr << "Data plane is listening at " << host << ":" << data_port
+            << std::endl;
+  std::thread([&data_server]() { data_server.listen_after_bind(); }).detach();
+
   {  // NOTE: Call register API on CMMU
     json j_body = json::object();
     j_body["port"] = port;
+    j_body["data_port"] = data_port;
     auto result = cmmu.Post("/register", j_body.dump(), "application/json");
+    json j_res;
     if (!result) {
       std::cerr << "Failed to register to CMMU: CMMU host (TODO FILL THIS WITH "
                    "ADDRESS) is down"
@@ -458,6 +1206,50 @@ int main(int argc, char* argv[]) {
       std::cerr << "Successfully registered to CMMU" << std::endl;
       std::cerr << "Body: " << result->body << std::endl;
     }
+
+    try {
+      j_res = json::parse(result->body);
+      shard_map = ShardMap(j_res.at("shards").get<std::vector<ShardInfo>>());
+    } catch (const std::exception& e) {
+      std::cerr << "Invalid register response: " << e.what() << std::endl;
+      return 1;
+    }
+
+    if (shard_map.empty()) {
+      shards.emplace_back(cmmu_host, cmmu_port);
+    }
+
+    // Register to the other shards with the ID we just got
+    self_id = j_res.at("id");
+    j_body["id"] = self_id;
+    for (auto& shard : shard_map.shards()) {
+      auto& conn = shards.emplace_back(shard.address, shard.port);
+      auto result = conn.Post("/register", j_body.dump(), "application/json");
+      if (result && result->status == httplib::StatusCode::Conflict_409) {
+        std::cerr << "CMMU shard " << shard.address << ":" << shard.port
+                  << " gave agent ID " << self_id
+                  << " to another agent, register every agent to the same "
+                     "shard first"
+                  << std::endl;
+        return 1;
+      }
+      if (!result || (result->status != 200 && result->status != 201)) {
+        std::cerr << "Failed to register to CMMU shard " << shard.address
+                  << ":" << shard.port << std::endl;
+        return 1;
+      }
+    }
+  }
+
+  if (auto interval = program.get<uint>("--reconcile-interval")) {
+    uint64_t rate = program.get<uint>("--gc-rate");
+    std::thread([datapath, interval, rate]() {
+      RateLimiter limiter(rate);
+      while (true) {
+        std::this_thread::sleep_for(std::chrono::seconds(interval));
+        reconcile(datapath, limiter);
+      }
+    }).detach();
   }
 
   // TODO: Add a default exception handler for server
@@ -2,33 +2,102 @@
 #include <httplib.h>
 #include <stduuid/uuid.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
+#include <deque>
 #include <exception>
 #include <format>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <nlohmann/json.hpp>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
 
+#include "data_plane.hpp"
+#include "metadata_store.hpp"
+#include "rate_limiter.hpp"
+#include "shard_map.hpp"
 #include "types.hpp"
 
 uint part_size;
+uint inline_threshold;
+
+/**
+ * A directory in the namespace tree
+ *
+ * Entries only store names, so the full path of a file is never saved
+ * anywhere. Renaming a directory only touches its old and new parent.
+ *
+ * NOTE: Names are views of strings interned in db.names()
+ */
+struct Directory {
+  uint64_t parent;                           // Inode number of the parent
+  std::map<std::string_view, uint64_t> children;  // Name -> inode number
+};
+
+const uint64_t root_inode = 1;
 
 // TODO: Use persistent storage
-std::vector<FileMetadata> db;
-std::vector<Agent> agents;
+MetadataStore db;
+std::unordered_map<uint64_t, Directory> dirs;  // Inode number -> directory
+uint64_t next_inode = root_inode + 1;
+std::shared_mutex db_mutex;  // Guards db, dirs and next_inode
+
+// Inodes visited per db_mutex hold by whole-store scans, so writers get in
+const uint64_t scan_chunk_size = 1 << 16;
+
+// Partition writes shed by a busy agent are retried with a doubling backoff
+const int partition_write_attempts = 5;
+const std::chrono::milliseconds partition_write_backoff(50);
 
-uint16_t add_agent(std::string address, uint16_t port) {
-  uint16_t id;
-  if (agents.size() == 0) {
-    id = 1;
+// NOTE: A deque so that references to agents survive new registrations
+std::deque<Agent> agents;
+std::mutex agents_mutex;  // Guards agents
+DataPlaneClientPool data_clients;
+
+// Every CMMU shard, empty when this CMMU is not sharded
+ShardMap shard_map;
+size_t shard_index;
+
+void request_rebalance();
+void queue_obsolete(uint16_t agent_id, const std::string& uuid);
+
+/**
+ * Add an agent, with the given ID if it is not 0
+ *
+ * Throws AgentIdConflictException if another agent already has that ID.
+ *
+ * NOTE: When sharded, agents register to one shard first and reuse the ID it
+ * gave them on the other shards, so partitions name agents the same way
+ * everywhere. Two shards can hand out the same ID to different agents, the
+ * second one to register elsewhere is then refused.
+ */
+uint16_t add_agent(std::string address, uint16_t port, uint16_t id = 0,
+                   uint16_t data_port = 0) {
+  std::lock_guard lock(agents_mutex);
+  if (id != 0) {
+    for (auto& a : agents) {
+      if (a.m_id == id) throw AgentIdConflictException(id);
+    }
   } else {
-    id = agents.back().m_id + 1;
+    for (auto& a : agents) id = std::max(id, a.m_id);
+    id++;
   }
 
-  agents.push_back({id, address, port});
+  agents.emplace_back(id, address, port, data_port);
   return id;
 }
 
 uint16_t find_agent(std::string address, uint16_t port) {
+  std::lock_guard lock(agents_mutex);
   for (auto& a : agents) {
     if (a.m_address == address && a.m_port == port) return a.m_id;
   }
@@ -37,106 +106,769 @@ uint16_t find_agent(std::string address, uint16_t port) {
 }
 
 /**
- * Get file metadata
+ * Get the address of an agent, returns false if it is unknown
+ */
+bool get_agent_address(uint16_t id, std::string& address, uint16_t& port) {
+  std::lock_guard lock(agents_mutex);
+  for (auto& a : agents) {
+    if (a.m_id == id) {
+      address = a.m_address;
+      port = a.m_port;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/**
+ * Get the agent holding the most bytes of a file, reads served there are
+ * mostly local. Returns null if the file has no partitions.
+ */
+json preferred_agent(const FileMetadata& metadata) {
+  std::unordered_map<uint16_t, uint64_t> bytes;
+  for (auto& part : metadata.partitions) {
+    bytes[part.agent_id] += std::max<uint64_t>(part.size, 1);
+  }
+
+  uint16_t best = 0;
+  uint64_t best_bytes = 0;
+  for (auto& [agent_id, n] : bytes) {
+    if (n > best_bytes || (n == best_bytes && agent_id < best)) {
+      best = agent_id;
+      best_bytes = n;
+    }
+  }
+
+  std::string address;
+  uint16_t port;
+  if (best_bytes == 0 || !get_agent_address(best, address, port)) return {};
+
+  return {{"id", best}, {"address", address}, {"port", port}};
+}
+
+/**
+ * Make sure this shard owns a path
+ */
+void check_owner(const std::string& filepath) {
+  if (shard_map.empty() || ShardMap::is_root(filepath)) return;
+  if (shard_map.owner(filepath) != shard_index) {
+    throw WrongShardException(filepath);
+  }
+}
+
+/**
+ * Create the root directory of the namespace
+ */
+void init_namespace() {
+  FileMetadata root;
+  root.filepath = "/";
+  root.inode_number = root_inode;
+  root.filetype = FileType::Directory;
+  root.size = 0;
+  root.uid = 0;
+  root.gid = 0;
+  root.perm_flags = 0x7770;
+
+  db.put(root);
+  dirs[root_inode] = {root_inode, {}};
+}
+
+/**
+ * Split a path into its components, ignoring empty ones
+ */
+std::vector<std::string> split_path(const std::string& filepath) {
+  std::vector<std::string> parts;
+  size_t start = 0;
+
+  while (start <= filepath.size()) {
+    size_t end = filepath.find('/', start);
+    if (end == std::string::npos) end = filepath.size();
+    if (end > start) parts.push_back(filepath.substr(start, end - start));
+    start = end + 1;
+  }
+
+  return parts;
+}
+
+/**
+ * Get the inode number of a file or directory
+ *
+ * NOTE: Caller must hold db_mutex
+ */
+uint64_t lookup(const std::string& filepath) {
+  uint64_t inode = root_inode;
+
+  for (auto& name : split_path(filepath)) {
+    auto dir = dirs.find(inode);
+    if (dir == dirs.end()) throw NotADirectoryException(filepath);
+
+    auto child = dir->second.children.find(name);
+    if (child == dir->second.children.end()) throw FileDNEException(filepath);
+    inode = child->second;
+  }
+
+  return inode;
+}
+
+/**
+ * Get the inode number of the parent directory of a path and the name of the
+ * entry in it
+ *
+ * NOTE: Caller must hold db_mutex
  */
-FileMetadata& get_file(const User& user, const std::string& filepath) {
-  for (auto& file : db) {
-    if (file.filepath == filepath) return file;
+std::pair<uint64_t, std::string> lookup_parent(const std::string& filepath) {
+  auto parts = split_path(filepath);
+  if (parts.empty()) {
+    throw std::invalid_argument("The root directory has no parent");
+  }
+
+  uint64_t inode = root_inode;
+  for (size_t i = 0; i + 1 < parts.size(); i++) {
+    auto dir = dirs.find(inode);
+    if (dir == dirs.end()) throw NotADirectoryException(filepath);
+
+    auto child = dir->second.children.find(parts[i]);
+    if (child == dir->second.children.end()) throw FileDNEException(filepath);
+    inode = child->second;
   }
 
-  throw FileDNEException(filepath);
+  if (!dirs.contains(inode)) throw NotADirectoryException(filepath);
+
+  return {inode, parts.back()};
+}
+
+/**
+ * Get file metadata
+ *
+ * NOTE: Caller must hold db_mutex
+ */
+FileMetadata get_file(const User& user, const std::string& filepath) {
+  return db.get(lookup(filepath));
 }
 
 /**
  * Create a file partition
  */
 FileMetadata::Partition create_partition(const uint64_t& part_id,
-                                         const std::string& content) {
+                                         std::string_view content) {
   static uint16_t aidx = 1;
   FileMetadata::Partition part;
 
+  std::unique_lock lock(agents_mutex);
   aidx = (aidx + 1) % agents.size();
   Agent& a = agents[aidx];
+  lock.unlock();
 
   part.filepath = uuids::to_string(uuids::uuid_system_generator{}());
   part.part_id = part_id;
   part.agent_id = a.m_id;
+  part.size = content.size();
 
-  // Push data to that node
-  httplib::MultipartFormDataItems items = {
-      {"name", content, part.filepath, "application/octet-stream"}};
-  auto res = a.m_conn.Post("/internal/write", items);
+  // Push data to that node, over the data plane if it has one. An overloaded
+  // agent sheds the write, back off and try again before giving up.
+  auto backoff = partition_write_backoff;
+  for (int attempt = 1;; attempt++) {
+    bool busy;
+    if (a.m_data_port != 0) {
+      try {
+        data_clients.get(a.m_address, a.m_data_port)
+            .write(part.filepath, content.data(), content.size());
+        return part;
+      } catch (const std::system_error& e) {
+        if (e.code() != std::errc::resource_unavailable_try_again) throw;
+        busy = true;
+      }
+    } else {
+      httplib::MultipartFormDataItems items = {
+          {"name", std::string(content), part.filepath,
+           "application/octet-stream"}};
+      auto res = a.m_conn.Post("/internal/write", items);
+      if (res && res->status == 201) return part;
+      busy = res && res->status == httplib::StatusCode::ServiceUnavailable_503;
+    }
 
-  if (res->status != 201) {
-    throw std::runtime_error(std::format(
-        "Failed to create partition %d on agent %d\n", part_id, a.m_id));
+    if (!busy || attempt == partition_write_attempts) {
+      throw std::runtime_error(std::format(
+          "Failed to create partition {} on agent {}", part_id, a.m_id));
+    }
+    std::this_thread::sleep_for(backoff);
+    backoff *= 2;
   }
+}
 
-  return part;
+/**
+ * Create an entry in its parent directory
+ *
+ * NOTE: Caller must hold db_mutex exclusively
+ */
+FileMetadata create_entry(const User& user, const std::string& filepath,
+                          FileType filetype) {
+  auto [parent_inode, name] = lookup_parent(filepath);
+  auto& parent = dirs.at(parent_inode);
+  if (parent.children.contains(name)) throw FileExistsException(filepath);
+
+  FileMetadata entry;
+  entry.filepath = filepath;
+  entry.inode_number = next_inode++;
+  entry.size = 0;
+  entry.filetype = filetype;
+  entry.uid = user.uid;
+  entry.gid = 0;
+  entry.perm_flags = 0x7770;
+
+  parent.children[db.names().intern(name)] = entry.inode_number;
+  if (filetype == FileType::Directory) {
+    dirs[entry.inode_number] = {parent_inode, {}};
+  }
+
+  db.put(entry);
+  return entry;
 }
 
 /**
  * Create a blank file
+ *
+ * NOTE: Caller must hold db_mutex exclusively
+ */
+FileMetadata create_file(const User& user, const std::string& filepath) {
+  return create_entry(user, filepath, FileType::File);
+}
+
+/**
+ * NOTE: Caller must hold db_mutex exclusively
  */
-FileMetadata& create_file(const User& user, const std::string& filepath) {
+FileMetadata get_or_create_file(const User& user,
+                                const std::string& filepath) {
   try {
-    get_file(user, filepath);
-    throw FileExistsException(filepath);
+    return get_file(user, filepath);
   } catch (const FileDNEException& e) {
-    // Create file
-    FileMetadata newfile;
-    newfile.filepath = filepath;
-    if (db.size() > 0) {
-      newfile.inode_number = db.back().inode_number + 1;
-    } else {
-      newfile.inode_number = 1;
+    return create_file(user, filepath);
+  }
+}
+
+/**
+ * Create a directory
+ *
+ * If `parents` is set, missing parent directories are created as well
+ */
+FileMetadata make_directory(const User& user, const std::string& filepath,
+                            bool parents) {
+  std::unique_lock lock(db_mutex);
+
+  if (!parents) {
+    FileMetadata dir = create_entry(user, filepath, FileType::Directory);
+    dir.filepath = filepath;
+    return dir;
+  }
+
+  std::string path;
+  FileMetadata dir = db.get(root_inode, false);
+  for (auto& name : split_path(filepath)) {
+    path += "/" + name;
+    try {
+      dir = get_file(user, path);
+      if (dir.filetype != FileType::Directory) {
+        throw NotADirectoryException(path);
+      }
+    } catch (const FileDNEException& e) {
+      dir = create_entry(user, path, FileType::Directory);
     }
+  }
 
-    newfile.size = 1;
-    newfile.filetype = FileType::File;
-    newfile.uid = user.uid;
-    newfile.gid = 0;
-    newfile.perm_flags = 0x7770;
+  dir.filepath = filepath;
+  return dir;
+}
 
-    db.push_back(newfile);
-    return db.back();
+/**
+ * List a page of a directory
+ *
+ * Entries are returned in name order, starting after `cursor`. The returned
+ * cursor is empty when there are no more entries.
+ */
+json read_directory(const User& user, const std::string& filepath,
+                    const std::string& cursor, uint64_t limit) {
+  std::shared_lock lock(db_mutex);
+
+  auto inode = lookup(filepath);
+  auto dir = dirs.find(inode);
+  if (dir == dirs.end()) throw NotADirectoryException(filepath);
+
+  auto& children = dir->second.children;
+  auto it = cursor.empty() ? children.begin() : children.upper_bound(cursor);
+
+  json entries = json::array();
+  for (; it != children.end() && entries.size() < limit; it++) {
+    auto child = db.get(it->second, false);
+    entries.push_back({{"name", it->first},
+                       {"inode_number", child.inode_number},
+                       {"filetype", child.filetype},
+                       {"size", child.size}});
   }
+
+  json page = json::object();
+  page["entries"] = entries;
+  page["cursor"] = it == children.end() ? "" : entries.back()["name"];
+  return page;
 }
 
-FileMetadata& get_or_create_file(const User& user,
-                                const std::string& filepath) noexcept {
-  try {
-    return get_file(user, filepath);
-  } catch (const FileDNEException& e) {
-    return create_file(user, filepath);
+/**
+ * Move a file or directory
+ *
+ * Only the two parent directories are modified, the descendants of a renamed
+ * directory are left untouched.
+ */
+void rename_entry(const User& user, const std::string& from,
+                  const std::string& to) {
+  std::unique_lock lock(db_mutex);
+
+  auto inode = lookup(from);
+  auto [src_inode, src_name] = lookup_parent(from);
+  auto [dst_inode, dst_name] = lookup_parent(to);
+  auto& src = dirs.at(src_inode);
+  auto& dst = dirs.at(dst_inode);
+
+  if (dst.children.contains(dst_name)) throw FileExistsException(to);
+
+  // Walk up from the destination to make sure we are not moving a directory
+  // into itself
+  for (uint64_t i = dst_inode;; i = dirs.at(i).parent) {
+    if (i == inode) {
+      throw std::invalid_argument("Cannot move a directory into itself");
+    }
+    if (i == root_inode) break;
+  }
+
+  auto old_name = src.children.find(src_name)->first;
+  src.children.erase(old_name);
+  db.names().release(old_name);
+  dst.children[db.names().intern(dst_name)] = inode;
+
+  auto dir = dirs.find(inode);
+  if (dir != dirs.end()) dir->second.parent = dst_inode;
+}
+
+/**
+ * Throw if `filepath` cannot be written as a file: its parent is missing or
+ * not a directory, or it is itself a directory
+ *
+ * NOTE: Caller must hold db_mutex
+ */
+void check_writable(const std::string& filepath) {
+  auto [parent_inode, name] = lookup_parent(filepath);
+  auto& children = dirs.at(parent_inode).children;
+  auto child = children.find(name);
+  if (child != children.end() && dirs.contains(child->second)) {
+    throw IsADirectoryException(filepath);
   }
 }
 
 FileMetadata write_file(const User& user, const std::string& filepath,
                         const std::string& content) {
-  FileMetadata& metadata = get_or_create_file(user, filepath);
   auto n = content.size();
+  std::vector<FileMetadata::Partition> partitions;
 
-  metadata.size = n;
-  metadata.partitions.clear();
+  // Fail before uploading anything if the path cannot be written. It may
+  // still change until the commit below.
+  {
+    std::shared_lock lock(db_mutex);
+    check_writable(filepath);
+  }
 
-  char buffer[part_size];
-  uint64_t offset = 0;
-  uint64_t count = 0;
+  try {
+    // Tiny files skip the agents entirely
+    if (n > inline_threshold) {
+      std::string_view view(content);
+      uint64_t offset = 0;
+      uint64_t count = 0;
+
+      while (offset < n) {
+        uint size =
+            (part_size - 1 < n - offset) ? part_size - 1 : (n - offset);
+        auto part = create_partition(count++, view.substr(offset, size));
+        offset += size;
+        partitions.push_back(part);
+      }
+    }
+
+    // Data is on the agents, now commit the metadata
+    std::unique_lock lock(db_mutex);
+    check_writable(filepath);
+    FileMetadata metadata = get_or_create_file(user, filepath);
+
+    for (auto& part : metadata.partitions) {
+      queue_obsolete(part.agent_id, part.filepath);
+    }
 
-  while (offset < n) {
-    uint size = (part_size - 1 < n - offset) ? part_size - 1 : (n - offset);
-    memset(buffer, 0, part_size);
-    memcpy(buffer, &content[offset], size);
-    auto part = create_partition(count++, std::string(buffer, size));
-    offset += size;
-    metadata.partitions.push_back(part);
+    metadata.size = n;
+    metadata.partitions = std::move(partitions);
+    metadata.is_inline = n <= inline_threshold;
+    metadata.inline_data = metadata.is_inline ? content : "";
+    db.put(metadata);
+
+    metadata.filepath = filepath;
+    return metadata;
+  } catch (...) {
+    // Nothing refers to the partitions uploaded so far
+    for (auto& part : partitions) {
+      queue_obsolete(part.agent_id, part.filepath);
+    }
+    throw;
   }
+}
+
+/**
+ * Background rebalancer
+ *
+ * Partitions stay on the agent they were written to, so agents that join
+ * later would sit empty. The rebalancer moves partitions from the most to the
+ * least loaded agents whenever an agent registers (and every
+ * `--rebalance-interval` seconds). The destination agent copies the data
+ * straight from the source agent, then the metadata is switched over.
+ */
+struct PartitionMove {
+  uint64_t inode;
+  uint64_t part_id;
+  PartitionId id;
+  uint64_t size;
+  uint16_t from;
+  uint16_t to;
+};
 
-  // TODO: Save to db
-  // We are using vector and reference
+const unsigned rebalance_parallelism = 4;
+const size_t rebalance_max_moves = 10000;      // Per round
 
-  return metadata;
+std::mutex rebalance_mutex;  // Guards rebalance_requested
+std::condition_variable rebalance_cond;
+bool rebalance_requested = false;
+
+void request_rebalance() {
+  {
+    std::lock_guard lock(rebalance_mutex);
+    rebalance_requested = true;
+  }
+  rebalance_cond.notify_one();
+}
+
+/**
+ * Plan moves that even out the number of bytes stored on each agent
+ */
+std::vector<PartitionMove> plan_rebalance() {
+  std::unordered_map<uint16_t, uint64_t> load;
+  {
+    std::lock_guard lock(agents_mutex);
+    for (auto& a : agents) load[a.m_id] = 0;
+  }
+  if (load.size() < 2) return {};
+
+  uint64_t end;
+  {
+    std::shared_lock lock(db_mutex);
+    for (auto& [agent_id, bytes] : db.agent_bytes()) {
+      if (load.contains(agent_id)) load[agent_id] = bytes;
+    }
+    end = db.inode_end();
+  }
+
+  // Only agents more than a partition above the mean give anything away, a
+  // balanced cluster is not scanned at all
+  uint64_t total = 0;
+  for (auto& [agent_id, bytes] : load) total += bytes;
+  uint64_t mean = total / load.size();
+
+  std::unordered_map<uint16_t, uint64_t> excess;
+  for (auto& [agent_id, bytes] : load) {
+    if (bytes > mean + part_size) excess[agent_id] = bytes - mean;
+  }
+
+  // Collect just enough partitions of those agents to cover their excess
+  std::unordered_map<uint16_t, std::vector<PartitionMove>> candidates;
+  size_t budget = rebalance_max_moves;
+  for (uint64_t first = 0; first < end && budget > 0 && !excess.empty();
+       first += scan_chunk_size) {
+    std::shared_lock lock(db_mutex);
+    db.scan_partitions(
+        [&](uint64_t inode, const CompactPartition& part) {
+          auto it = excess.find(part.agent_id);
+          if (it == excess.end() || part.size == 0) return true;
+
+          candidates[part.agent_id].push_back({inode, part.part_id, part.id,
+                                               part.size, part.agent_id, 0});
+          if (part.size >= it->second) {
+            excess.erase(it);
+          } else {
+            it->second -= part.size;
+          }
+          return --budget > 0 && !excess.empty();
+        },
+        first, first + scan_chunk_size);
+  }
+
+  // Greedily move a partition from the most to the least loaded agent as long
+  // as it makes the two closer
+  std::vector<PartitionMove> moves;
+  while (true) {
+    auto [min, max] = std::minmax_element(
+        load.begin(), load.end(),
+        [](auto& a, auto& b) { return a.second < b.second; });
+    uint64_t diff = max->second - min->second;
+
+    auto& parts = candidates[max->first];
+    auto it = std::find_if(parts.rbegin(), parts.rend(), [diff](auto& p) {
+      return p.size < diff;
+    });
+    if (it == parts.rend()) break;
+
+    PartitionMove move = *it;
+    parts.erase(std::next(it).base());
+    move.to = min->first;
+    max->second -= move.size;
+    min->second += move.size;
+    moves.push_back(move);
+  }
+
+  return moves;
+}
+
+/**
+ * Copy a partition to its new agent and point the metadata to it
+ */
+void move_partition(const PartitionMove& move, RateLimiter& limiter) {
+  std::string from_address, to_address;
+  uint16_t from_port, to_port;
+  if (!get_agent_address(move.from, from_address, from_port) ||
+      !get_agent_address(move.to, to_address, to_port)) {
+    return;
+  }
+
+  limiter.acquire(move.size);
+  std::string uuid = move.id.to_string();
+
+  json j_body = json::object();
+  j_body["filepath"] = uuid;
+  j_body["address"] = from_address;
+  j_body["port"] = from_port;
+
+  httplib::Client to(to_address, to_port);
+  auto result = to.Post("/internal/fetch", j_body.dump(), "application/json");
+  if (!result || result->status != 201) {
+    std::cerr << "Failed to move partition " << uuid << " to agent "
+              << move.to << std::endl;
+    return;
+  }
+
+  // Only switch over if the file was not rewritten in the meantime. The copy
+  // that is not referenced anymore is queued under the lock, so agents never
+  // see it as orphaned in between.
+  std::unique_lock lock(db_mutex);
+  bool moved =
+      db.move_partition(move.inode, move.part_id, move.id, move.from, move.to);
+  queue_obsolete(moved ? move.from : move.to, uuid);
+}
+
+void rebalancer(uint64_t bandwidth, std::chrono::seconds interval) {
+  RateLimiter limiter(bandwidth);
+
+  while (true) {
+    {
+      std::unique_lock lock(rebalance_mutex);
+      rebalance_cond.wait_for(lock, interval,
+                              []() { return rebalance_requested; });
+      rebalance_requested = false;
+    }
+
+    auto moves = plan_rebalance();
+    if (moves.empty()) continue;
+    std::cerr << "Rebalancing " << moves.size() << " partitions" << std::endl;
+
+    std::atomic<size_t> next = 0;
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < rebalance_parallelism; i++) {
+      workers.emplace_back([&]() {
+        for (size_t m = next++; m < moves.size(); m = next++) {
+          move_partition(moves[m], limiter);
+        }
+      });
+    }
+    for (auto& w : workers) w.join();
+  }
+}
+
+/**
+ * Garbage collection of partitions that are no longer referenced
+ *
+ * Rewritten files and rebalanced partitions leave their old copies on the
+ * agents. They are queued here and a background thread deletes them in
+ * batches per agent, at most `--gc-rate` partitions per second. Deletion
+ * waits for a grace period so that readers holding old metadata can finish.
+ */
+struct ObsoletePartition {
+  uint16_t agent_id;
+  std::string uuid;
+  std::chrono::steady_clock::time_point time;
+};
+
+const auto gc_grace_period = std::chrono::seconds(30);
+const size_t gc_batch_size = 1000;
+
+std::mutex gc_mutex;                     // Guards gc_queue
+std::deque<ObsoletePartition> gc_queue;  // Oldest first
+
+void queue_obsolete(uint16_t agent_id, const std::string& uuid) {
+  std::lock_guard lock(gc_mutex);
+  gc_queue.push_back({agent_id, uuid, std::chrono::steady_clock::now()});
+}
+
+void delete_partitions(uint16_t agent_id,
+                       const std::vector<std::string>& uuids) {
+  std::string address;
+  uint16_t port;
+  if (!get_agent_address(agent_id, address, port)) return;
+
+  json j_body = json::object();
+  j_body["filepaths"] = uuids;
+  httplib::Client a(address, port);
+  auto result = a.Post("/internal/delete", j_body.dump(), "application/json");
+
+  // NOTE: Agents reconcile their disks periodically, so whatever fails here
+  // is not lost forever
+  if (!result || result->status != 200) {
+    std::cerr << "Failed to delete " << uuids.size()
+              << " partitions on agent " << agent_id << std::endl;
+  }
+}
+
+void garbage_collector(uint64_t rate) {
+  RateLimiter limiter(rate);
+
+  while (true) {
+    std::unordered_map<uint16_t, std::vector<std::string>> batches;
+    size_t count = 0;
+    {
+      std::lock_guard lock(gc_mutex);
+      auto now = std::chrono::steady_clock::now();
+      while (!gc_queue.empty() && count < gc_batch_size &&
+             now - gc_queue.front().time >= gc_grace_period) {
+        auto& obsolete = gc_queue.front();
+        batches[obsolete.agent_id].push_back(std::move(obsolete.uuid));
+        gc_queue.pop_front();
+        count++;
+      }
+    }
+
+    if (count == 0) {
+      std::this_thread::sleep_for(std::chrono::seconds(1));
+      continue;
+    }
+
+    for (auto& [agent_id, uuids] : batches) {
+      limiter.acquire(uuids.size());
+      delete_partitions(agent_id, uuids);
+    }
+  }
+}
+
+/**
+ * Partitions referenced on one agent, sorted
+ *
+ * Agents ask about their whole disk in batches, so the IDs are collected once
+ * and reused for the following batches. A snapshot may keep partitions that
+ * were since removed, those are caught by the next reconcile. It cannot miss
+ * a partition that agents would ask about: they only ask about files older
+ * than 10 minutes, and moved or rewritten partitions get a new file.
+ *
+ * NOTE: Metadata must be committed within 10 minutes minus
+ * `referenced_snapshot_ttl` of its partitions being written.
+ */
+struct ReferencedSnapshot {
+  std::chrono::steady_clock::time_point time;
+  std::shared_ptr<const std::vector<PartitionId>> ids;
+};
+
+const auto referenced_snapshot_ttl = std::chrono::minutes(1);
+
+std::mutex referenced_mutex;  // Guards referenced_snapshots
+std::unordered_map<uint16_t, ReferencedSnapshot> referenced_snapshots;
+
+/**
+ * Get the partitions referenced on an agent, from a recent snapshot if any
+ *
+ * The store is scanned in chunks so that writes are not held back for the
+ * whole scan.
+ */
+std::shared_ptr<const std::vector<PartitionId>> referenced_on(
+    uint16_t agent_id) {
+  std::lock_guard lock(referenced_mutex);
+  auto now = std::chrono::steady_clock::now();
+  std::erase_if(referenced_snapshots, [now](auto& entry) {
+    return now - entry.second.time >= referenced_snapshot_ttl;
+  });
+
+  auto it = referenced_snapshots.find(agent_id);
+  if (it != referenced_snapshots.end()) return it->second.ids;
+
+  std::vector<PartitionId> ids;
+  uint64_t end;
+  {
+    std::shared_lock db_lock(db_mutex);
+    end = db.inode_end();
+  }
+  for (uint64_t first = 0; first < end; first += scan_chunk_size) {
+    std::shared_lock db_lock(db_mutex);
+    db.scan_partitions(
+        [&](uint64_t inode, const CompactPartition& part) {
+          if (part.agent_id == agent_id) ids.push_back(part.id);
+          return true;
+        },
+        first, first + scan_chunk_size);
+  }
+  std::sort(ids.begin(), ids.end(),
+            [](auto& a, auto& b) { return a.bytes < b.bytes; });
+
+  auto& snapshot = referenced_snapshots[agent_id];
+  snapshot = {now, std::make_shared<const std::vector<PartitionId>>(
+                       std::move(ids))};
+  return snapshot.ids;
+}
+
+/**
+ * Get which of the given partitions of an agent are still referenced
+ *
+ * Partitions waiting in the GC queue count as referenced, the queue deletes
+ * them once their grace period is over.
+ */
+std::vector<std::string> referenced_partitions(
+    uint16_t agent_id, const std::vector<std::string>& uuids) {
+  auto ids = referenced_on(agent_id);
+  std::vector<bool> referenced(uuids.size(), false);
+  std::unordered_map<std::string_view, size_t> missing;
+  for (size_t i = 0; i < uuids.size(); i++) {
+    try {
+      referenced[i] = std::binary_search(
+          ids->begin(), ids->end(), PartitionId::from_string(uuids[i]),
+          [](auto& a, auto& b) { return a.bytes < b.bytes; });
+      if (!referenced[i]) missing[uuids[i]] = i;
+    } catch (const std::invalid_argument& e) {
+      // Not a partition
+    }
+  }
+
+  // Partitions leave the metadata and enter the GC queue together under
+  // db_mutex, so one missing from the snapshot is already queued
+  if (!missing.empty()) {
+    std::lock_guard lock(gc_mutex);
+    for (auto& obsolete : gc_queue) {
+      if (obsolete.agent_id != agent_id) continue;
+      auto it = missing.find(obsolete.uuid);
+      if (it != missing.end()) referenced[it->second] = true;
+    }
+  }
+
+  std::vector<std::string> ret;
+  for (size_t i = 0; i < uuids.size(); i++) {
+    if (referenced[i]) ret.push_back(uuids[i]);
+  }
+  return ret;
 }
 
 int main(int argc, char* argv[]) {
@@ -161,6 +893,43 @@ int main(int argc, char* argv[]) {
       .scan<'u', uint>()
       .nargs(1);
 
+  program.add_argument("-I", "--inline-threshold")
+      .help("Files up to this size in bytes are stored inline in the metadata")
+      .default_value((uint)4096)
+      .scan<'u', uint>()
+      .nargs(1);
+
+  program.add_argument("--rebalance-bandwidth")
+      .help("Max MB/s copied between agents by the rebalancer, 0 for no limit")
+      .default_value((uint)50)
+      .scan<'u', uint>()
+      .nargs(1);
+
+  program.add_argument("--rebalance-interval")
+      .help("Seconds between two rebalancing rounds")
+      .default_value((uint)60)
+      .scan<'u', uint>()
+      .nargs(1);
+
+  program.add_argument("--gc-rate")
+      .help("Max partitions per second deleted by the garbage collector, 0 "
+            "for no limit")
+      .default_value((uint)1000)
+      .scan<'u', uint>()
+      .nargs(1);
+
+  program.add_argument("--shards")
+      .help("Comma separated host:port of every CMMU shard, in the same order "
+            "on all shards. Leave empty to run a single CMMU")
+      .default_value<std::string>("")
+      .nargs(1);
+
+  program.add_argument("--shard")
+      .help("Index of this CMMU in --shards")
+      .default_value((uint)0)
+      .scan<'u', uint>()
+      .nargs(1);
+
   try {
     program.parse_args(argc, argv);
   } catch(const std::exception& e) {
@@ -172,6 +941,37 @@ int main(int argc, char* argv[]) {
   std::string host = program.get("-h");
   uint port = program.get<uint>("-p");
   part_size = program.get<uint>("-P");
+  data_clients.set_max_data(part_size);
+  inline_threshold = program.get<uint>("-I");
+
+  try {
+    shard_map = ShardMap::parse(program.get("--shards"));
+    shard_index = program.get<uint>("--shard");
+  } catch (const std::exception& e) {
+    std::cerr << "Error while parsing shards: " << e.what() << std::endl;
+    return 1;
+  }
+
+  if (!shard_map.empty() && shard_index >= shard_map.size()) {
+    std::cerr << "--shard must be an index in --shards" << std::endl;
+    return 1;
+  }
+
+  uint rebalance_interval = program.get<uint>("--rebalance-interval");
+  if (rebalance_interval < 1) {
+    std::cerr << "--rebalance-interval must be at least 1" << std::endl;
+    return 1;
+  }
+
+  init_namespace();
+
+  std::thread(rebalancer,
+              (uint64_t)program.get<uint>("--rebalance-bandwidth") * 1024 *
+                  1024,
+              std::chrono::seconds(rebalance_interval))
+      .detach();
+  std::thread(garbage_collector, (uint64_t)program.get<uint>("--gc-rate"))
+      .detach();
 
   httplib::Server server;
 
@@ -181,6 +981,9 @@ int main(int argc, char* argv[]) {
    * body: {
    *  filepath: string
    * }
+   *
+   * response: the file metadata, with `preferred_agent` ({id, address, port}
+   * or null) set to the agent reads should be routed to
    */
   server.Post("/stat", [](const httplib::Request& req, httplib::Response& res) {
     // Parse the body of the request
@@ -194,11 +997,16 @@ int main(int argc, char* argv[]) {
     }
 
     try {
+      check_owner(body.at("filepath"));
+      std::shared_lock lock(db_mutex);
       FileMetadata metadata = get_file({0}, body["filepath"]);
+      lock.unlock();
+      metadata.filepath = body["filepath"];
 
       // TODO: Check for permission
 
       json j_metadata = metadata;
+      j_metadata["preferred_agent"] = preferred_agent(metadata);
       res.set_content(j_metadata.dump(), "application/json");
       res.status = httplib::StatusCode::OK_200;
     } catch (const FileDNEException& e) {
@@ -206,6 +1014,10 @@ int main(int argc, char* argv[]) {
       res.status = httplib::StatusCode::NotFound_404;
       res.set_content(e.what(), "text/plain");
       return;
+    } catch (const WrongShardException& e) {
+      res.status = httplib::StatusCode::MisdirectedRequest_421;
+      res.set_content(e.what(), "text/plain");
+      return;
     } catch (const std::exception& e) {  // TODO: Handle different exceptions
       std::cerr << "Error while getting file: " << e.what() << std::endl;
       res.status = httplib::StatusCode::BadRequest_400;
@@ -237,7 +1049,29 @@ int main(int argc, char* argv[]) {
         auto& file = req.files.begin()->second;
         // Passing user with uid 0 for now
         // TODO: Use content receiver instead
-        auto file_metadata = write_file({0}, file.name, file.content);
+        FileMetadata file_metadata;
+        try {
+          check_owner(file.name);
+          file_metadata = write_file({0}, file.name, file.content);
+        } catch (const WrongShardException& e) {
+          res.status = httplib::StatusCode::MisdirectedRequest_421;
+          res.set_content(e.what(), "text/plain");
+          return;
+        } catch (const FileDNEException& e) {
+          res.status = httplib::StatusCode::NotFound_404;
+          res.set_content(e.what(), "text/plain");
+          return;
+        } catch (const IsADirectoryException& e) {
+          res.status = httplib::StatusCode::Conflict_409;
+          res.set_content(e.what(), "text/plain");
+          return;
+        } catch (const std::exception& e) {
+          std::cerr << "Error while writing file: " << e.what() << std::endl;
+          res.status = httplib::StatusCode::BadRequest_400;
+          res.set_content(e.what(), "text/plain");
+          return;
+        }
+
         try {
           json j_file_metadata = file_metadata;
           std::string s_file_metadata = j_file_metadata.dump();
@@ -249,6 +1083,143 @@ int main(int argc, char* argv[]) {
         }
       });
 
+  /**
+   * Create a directory
+   *
+   * body: {
+   *  filepath: string,
+   *  parents: bool (optional, create missing parents like `mkdir -p`)
+   * }
+   */
+  server.Post(
+      "/mkdir", [](const httplib::Request& req, httplib::Response& res) {
+        json body;
+        try {
+          body = json::parse(req.body);
+        } catch (const json::parse_error&) {
+          res.status = httplib::StatusCode::BadRequest_400;
+          res.set_content("Invalid body", "text/plain");
+          return;
+        }
+
+        try {
+          check_owner(body.at("filepath"));
+          FileMetadata metadata = make_directory(
+              {0}, body.at("filepath"), body.value("parents", false));
+
+          json j_metadata = metadata;
+          res.set_content(j_metadata.dump(), "application/json");
+          res.status = httplib::StatusCode::Created_201;
+        } catch (const FileDNEException& e) {
+          res.status = httplib::StatusCode::NotFound_404;
+          res.set_content(e.what(), "text/plain");
+        } catch (const FileExistsException& e) {
+          res.status = httplib::StatusCode::Conflict_409;
+          res.set_content(e.what(), "text/plain");
+        } catch (const WrongShardException& e) {
+          res.status = httplib::StatusCode::MisdirectedRequest_421;
+          res.set_content(e.what(), "text/plain");
+        } catch (const std::exception& e) {
+          std::cerr << "Error while creating directory: " << e.what()
+                    << std::endl;
+          res.status = httplib::StatusCode::BadRequest_400;
+          res.set_content(e.what(), "text/plain");
+        }
+      });
+
+  /**
+   * List a directory, one page at a time
+   *
+   * body: {
+   *  filepath: string,
+   *  cursor: string (optional, cursor returned by the previous page),
+   *  limit: int (optional, max number of entries in the page)
+   * }
+   *
+   * response: {
+   *  entries: [{name, inode_number, filetype, size}],
+   *  cursor: string (empty when this is the last page)
+   * }
+   */
+  server.Post(
+      "/readdir", [](const httplib::Request& req, httplib::Response& res) {
+        json body;
+        try {
+          body = json::parse(req.body);
+        } catch (const json::parse_error&) {
+          res.status = httplib::StatusCode::BadRequest_400;
+          res.set_content("Invalid body", "text/plain");
+          return;
+        }
+
+        try {
+          uint64_t limit = body.value("limit", (uint64_t)1000);
+          if (limit == 0) {
+            res.status = httplib::StatusCode::BadRequest_400;
+            res.set_content("Limit must be positive", "text/plain");
+            return;
+          }
+
+          check_owner(body.at("filepath"));
+          json page = read_directory({0}, body.at("filepath"),
+                                     body.value("cursor", ""), limit);
+          res.set_content(page.dump(), "application/json");
+          res.status = httplib::StatusCode::OK_200;
+        } catch (const FileDNEException& e) {
+          res.status = httplib::StatusCode::NotFound_404;
+          res.set_content(e.what(), "text/plain");
+        } catch (const WrongShardException& e) {
+          res.status = httplib::StatusCode::MisdirectedRequest_421;
+          res.set_content(e.what(), "text/plain");
+        } catch (const std::exception& e) {
+          std::cerr << "Error while listing directory: " << e.what()
+                    << std::endl;
+          res.status = httplib::StatusCode::BadRequest_400;
+          res.set_content(e.what(), "text/plain");
+        }
+      });
+
+  /**
+   * Move a file or directory
+   *
+   * body: {
+   *  from: string,
+   *  to: string
+   * }
+   */
+  server.Post(
+      "/rename", [](const httplib::Request& req, httplib::Response& res) {
+        json body;
+        try {
+          body = json::parse(req.body);
+        } catch (const json::parse_error&) {
+          res.status = httplib::StatusCode::BadRequest_400;
+          res.set_content("Invalid body", "text/plain");
+          return;
+        }
+
+        try {
+          check_owner(body.at("from"));
+          check_owner(body.at("to"));
+          rename_entry({0}, body.at("from"), body.at("to"));
+          res.status = httplib::StatusCode::OK_200;
+          res.set_content("Renamed", "text/plain");
+        } catch (const FileDNEException& e) {
+          res.status = httplib::StatusCode::NotFound_404;
+          res.set_content(e.what(), "text/plain");
+        } catch (const FileExistsException& e) {
+          res.status = httplib::StatusCode::Conflict_409;
+          res.set_content(e.what(), "text/plain");
+        } catch (const WrongShardException& e) {
+          res.status = httplib::StatusCode::MisdirectedRequest_421;
+          res.set_content(e.what(), "text/plain");
+        } catch (const std::exception& e) {
+          std::cerr << "Error while renaming: " << e.what() << std::endl;
+          res.status = httplib::StatusCode::BadRequest_400;
+          res.set_content(e.what(), "text/plain");
+        }
+      });
+
   /**
    * Register agent
    *
@@ -256,6 +1227,13 @@ int main(int argc, char* argv[]) {
    *
    * Body:
    *  - port: int
+   *  - id: int (optional, ID given by another shard)
+   *  - data_port: int (optional, port of the agent's binary data plane)
+   *
+   * Response: {
+   *  id: int (ID of the agent),
+   *  shards: [{address, port}] (every CMMU shard, empty if not sharded)
+   * }
    */
   server.Post(
       "/register", [](const httplib::Request& req, httplib::Response& res) {
@@ -277,14 +1255,28 @@ int main(int argc, char* argv[]) {
 
         uint16_t agent_port = j_body["port"];
 
-        if (find_agent(req.remote_addr, agent_port) == 0) {
-          add_agent(req.remote_addr, agent_port);
-          res.status = httplib::StatusCode::Created_201;
-          res.set_content("Registered", "text/plain");
-        } else {
-          res.status = httplib::StatusCode::Created_201;
-          res.set_content("Welcome back", "text/plain");
+        json j_res = json::object();
+        j_res["shards"] = shard_map.shards();
+
+        uint16_t requested_id = j_body.value("id", 0);
+        uint16_t id = find_agent(req.remote_addr, agent_port);
+        try {
+          if (id == 0) {
+            id = add_agent(req.remote_addr, agent_port, requested_id,
+                           j_body.value("data_port", 0));
+            request_rebalance();
+          } else if (requested_id != 0 && requested_id != id) {
+            throw AgentIdConflictException(requested_id);
+          }
+        } catch (const AgentIdConflictException& e) {
+          res.status = httplib::StatusCode::Conflict_409;
+          res.set_content(e.what(), "text/plain");
+          return;
         }
+
+        j_res["id"] = id;
+        res.status = httplib::StatusCode::Created_201;
+        res.set_content(j_res.dump(), "application/json");
       });
 
   /**
@@ -296,12 +1288,14 @@ int main(int argc, char* argv[]) {
   server.Post("/agents",
               [](const httplib::Request& req, httplib::Response& res) {
                 try {
+                  std::lock_guard lock(agents_mutex);
                   json j_res = json::array();
                   for (auto& a : agents) {
                     json agent = json::object();
                     agent["id"] = a.m_id;
                     agent["address"] = a.m_address;
                     agent["port"] = a.m_port;
+                    agent["data_port"] = a.m_data_port;
                     j_res.push_back(agent);
                   }
 
@@ -315,6 +1309,73 @@ int main(int argc, char* argv[]) {
                 }
               });
 
+  /**
+   * NOTE: Should only be called by agents
+   *
+   * Agents send their on-disk inventory to find out which partitions are
+   * orphaned
+   *
+   * body: {
+   *  agent_id: int,
+   *  filepaths: [string]
+   * }
+   *
+   * response: {
+   *  referenced: [string] (the filepaths that must be kept)
+   * }
+   */
+  server.Post("/internal/referenced", [](const httplib::Request& req,
+                                         httplib::Response& res) {
+    json body;
+    try {
+      body = json::parse(req.body);
+    } catch (const json::parse_error&) {
+      res.status = httplib::StatusCode::BadRequest_400;
+      res.set_content("Invalid body", "text/plain");
+      return;
+    }
+
+    try {
+      json j_res = json::object();
+      j_res["referenced"] = referenced_partitions(
+          body.at("agent_id"),
+          body.at("filepaths").get<std::vector<std::string>>());
+      res.set_content(j_res.dump(), "application/json");
+      res.status = httplib::StatusCode::OK_200;
+    } catch (const std::exception& e) {
+      res.status = httplib::StatusCode::BadRequest_400;
+      res.set_content(e.what(), "text/plain");
+    }
+  });
+
+  /**
+   * Get an estimate of the memory used by the metadata
+   *
+   * NOTE: Only be used for sizing/debugging
+   */
+  server.Get("/internal/memory",
+             [](const httplib::Request& req, httplib::Response& res) {
+               std::shared_lock lock(db_mutex);
+               json j_res = db.memory_usage();
+
+               // Directory entries: a tree node holding a name view and inode
+               uint64_t entries = 0;
+               for (auto& [inode, dir] : dirs) entries += dir.children.size();
+               j_res["dirent_bytes"] =
+                   entries * (4 * sizeof(void*) + sizeof(std::string_view) +
+                              sizeof(uint64_t));
+
+               uint64_t total = 0;
+               for (auto& [key, value] : j_res.items()) {
+                 if (key.ends_with("_bytes")) total += value.get<uint64_t>();
+               }
+               uint64_t files = j_res["files"];
+               j_res["bytes_per_file"] = files == 0 ? 0 : total / files;
+
+               res.set_content(j_res.dump(), "application/json");
+               res.status = httplib::StatusCode::OK_200;
+             });
+
   // TODO: Add a default exception handler for server
   std::cerr << "Server is listening at " << host << ":" << port << std::endl;
   server.listen(host, port);
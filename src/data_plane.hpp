@@ -0,0 +1,578 @@
+#pragma once
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+/**
+ * Binary data plane for moving partitions between nodes
+ *
+ * HTTP stays the control plane, partition bytes go over persistent TCP
+ * connections as length-prefixed frames instead of multipart bodies, so they
+ * are never scanned for a boundary and land in their final buffer with a
+ * single copy. Every frame carries a stream ID: a connection has many
+ * transfers in flight and responses come back in completion order. Frames are
+ * sent with one sendmsg, the header and payload are never concatenated.
+ *
+ * Frame: a 24 byte header, the name, then the payload
+ *
+ *   magic u32 | op u8 | status u8 | unused u16 | stream u32 |
+ *   name_len u32 | data_len u64
+ *
+ * Integers are little-endian. A request names a partition, a write carries
+ * its content and a read response carries the partition. Error responses
+ * carry the error message, Busy ones ask to retry later. Both ends refuse
+ * payloads larger than their `max_data` (at least the partition size) and
+ * drop the connection.
+ */
+enum class DataOp : uint8_t { Write = 1, Read = 2 };
+enum class DataStatus : uint8_t { Ok = 0, NotFound = 1, Error = 2, Busy = 3 };
+
+struct DataFrame {
+  DataOp op;
+  DataStatus status;
+  uint32_t stream;
+  std::string name;
+  std::string data;
+};
+
+namespace data_plane_detail {
+
+const uint32_t MAGIC = 0x31534644;  // "DFS1"
+const size_t HEADER_SIZE = 24;
+const uint32_t MAX_NAME = 4096;
+const uint64_t DEFAULT_MAX_DATA = 64 << 20;
+
+inline void put_le(uint8_t* p, uint64_t v, size_t n) {
+  for (size_t i = 0; i < n; i++) p[i] = v >> (8 * i);
+}
+
+inline uint64_t get_le(const uint8_t* p, size_t n) {
+  uint64_t v = 0;
+  for (size_t i = 0; i < n; i++) v |= (uint64_t)p[i] << (8 * i);
+  return v;
+}
+
+inline bool read_full(int fd, char* buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = recv(fd, buf, len, 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    buf += n;
+    len -= n;
+  }
+  return true;
+}
+
+/**
+ * Read a whole frame, returns false on EOF, error or a malformed frame,
+ * including one carrying more than `max_data` bytes
+ */
+inline bool read_frame(int fd, DataFrame& frame, uint64_t max_data) {
+  uint8_t header[HEADER_SIZE];
+  if (!read_full(fd, (char*)header, HEADER_SIZE)) return false;
+  if (get_le(header, 4) != MAGIC) return false;
+
+  uint64_t name_len = get_le(header + 12, 4);
+  uint64_t data_len = get_le(header + 16, 8);
+  if (name_len > MAX_NAME || data_len > max_data) return false;
+
+  frame.op = (DataOp)header[4];
+  frame.status = (DataStatus)header[5];
+  frame.stream = get_le(header + 8, 4);
+  try {
+    frame.name.resize(name_len);
+    frame.data.resize(data_len);
+  } catch (const std::bad_alloc& e) {
+    return false;
+  }
+  return read_full(fd, frame.name.data(), name_len) &&
+         read_full(fd, frame.data.data(), data_len);
+}
+
+/**
+ * Send a frame with a single gathered write, returns false on error
+ */
+inline bool write_frame(int fd, DataOp op, DataStatus status, uint32_t stream,
+                        const std::string& name, const char* data,
+                        size_t size) {
+  uint8_t header[HEADER_SIZE] = {};
+  put_le(header, MAGIC, 4);
+  header[4] = (uint8_t)op;
+  header[5] = (uint8_t)status;
+  put_le(header + 8, stream, 4);
+  put_le(header + 12, name.size(), 4);
+  put_le(header + 16, size, 8);
+
+  iovec iov[3] = {{header, HEADER_SIZE},
+                  {const_cast<char*>(name.data()), name.size()},
+                  {const_cast<char*>(data), size}};
+  msghdr msg = {};
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 3;
+
+  while (msg.msg_iovlen > 0) {
+    ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) return false;
+
+    // Skip what was sent, the kernel may stop anywhere
+    while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len) {
+      n -= msg.msg_iov->iov_len;
+      msg.msg_iov++;
+      msg.msg_iovlen--;
+    }
+    if (msg.msg_iovlen > 0) {
+      msg.msg_iov->iov_base = (char*)msg.msg_iov->iov_base + n;
+      msg.msg_iov->iov_len -= n;
+    }
+  }
+  return true;
+}
+
+inline void set_nodelay(int fd) {
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+}  // namespace data_plane_detail
+
+/**
+ * Data plane server
+ *
+ * Every connection has a thread reading its frames, requests are handled on a
+ * pool of `threads` workers. The handler answers each request exactly once
+ * through `respond`, with the payload of a read (or nullptr) or the error,
+ * either before returning or later from another thread (e.g. when the disk
+ * is done), so workers never wait on the disk. A handler may instead throw
+ * before answering. std::system_error with
+ * std::errc::no_such_file_or_directory is reported as NotFound, and with
+ * std::errc::resource_unavailable_try_again as Busy. A connection sending a
+ * frame over `max_data` bytes is closed.
+ */
+class DataPlaneServer {
+ public:
+  using Payload = std::shared_ptr<const std::string>;
+  using Respond = std::function<void(Payload payload, std::exception_ptr)>;
+  using Handler = std::function<void(DataFrame& request, Respond respond)>;
+
+  DataPlaneServer(Handler handler, unsigned threads = 8,
+                  uint64_t max_data = data_plane_detail::DEFAULT_MAX_DATA)
+      : m_handler(std::move(handler)),
+        m_max_queued(threads * 4),
+        m_max_data(max_data) {
+    for (unsigned i = 0; i < threads; i++) {
+      m_workers.emplace_back([this]() { work(); });
+    }
+  }
+
+  ~DataPlaneServer() {
+    stop();
+    {
+      std::unique_lock lock(m_conns_mutex);
+      m_conns_cond.wait(lock, [this]() { return m_conns.empty(); });
+    }
+    {
+      std::lock_guard lock(m_mutex);
+      m_stop = true;
+    }
+    m_cond.notify_all();
+    for (auto& t : m_workers) t.join();
+  }
+
+  /**
+   * Accept connections until stop() is called, returns false if the address
+   * cannot be listened on
+   */
+  bool listen(const std::string& host, uint16_t port) {
+    if (!bind_to_port(host, port)) return false;
+    listen_after_bind();
+    return true;
+  }
+
+  /**
+   * Open the listening socket, so that peers can connect before
+   * listen_after_bind() starts accepting
+   */
+  bool bind_to_port(const std::string& host, uint16_t port) {
+    addrinfo hints = {}, *addrs;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints,
+                    &addrs) != 0) {
+      return false;
+    }
+
+    int fd = socket(addrs->ai_family, addrs->ai_socktype, 0);
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    bool ok = fd >= 0 && bind(fd, addrs->ai_addr, addrs->ai_addrlen) == 0 &&
+              ::listen(fd, SOMAXCONN) == 0;
+    freeaddrinfo(addrs);
+    if (!ok) {
+      if (fd >= 0) close(fd);
+      return false;
+    }
+
+    std::lock_guard lock(m_conns_mutex);
+    m_listen_fd = fd;
+    return true;
+  }
+
+  /**
+   * Open the listening socket on a port chosen by the system, returns the
+   * port or -1 on failure
+   */
+  int bind_to_any_port(const std::string& host) {
+    if (!bind_to_port(host, 0)) return -1;
+
+    sockaddr_storage addr = {};
+    socklen_t len = sizeof(addr);
+    std::lock_guard lock(m_conns_mutex);
+    if (getsockname(m_listen_fd, (sockaddr*)&addr, &len) != 0) return -1;
+    return ntohs(addr.ss_family == AF_INET6
+                     ? ((sockaddr_in6*)&addr)->sin6_port
+                     : ((sockaddr_in*)&addr)->sin_port);
+  }
+
+  void listen_after_bind() {
+    int fd;
+    {
+      std::lock_guard lock(m_conns_mutex);
+      fd = m_listen_fd;
+    }
+    if (fd < 0) return;
+
+    while (true) {
+      int conn = accept(fd, nullptr, nullptr);
+      if (conn < 0 && errno == EINTR) continue;
+      if (conn < 0) break;
+
+      data_plane_detail::set_nodelay(conn);
+      std::lock_guard lock(m_conns_mutex);
+      if (m_listen_fd < 0) {  // Stopped in the meantime
+        close(conn);
+        break;
+      }
+      auto c = std::make_shared<Connection>(conn);
+      m_conns.insert(conn);
+      std::thread([this, c]() { serve(c); }).detach();
+    }
+
+    close(fd);
+  }
+
+  /**
+   * Stop accepting connections and drop the open ones
+   */
+  void stop() {
+    std::lock_guard lock(m_conns_mutex);
+    if (m_listen_fd >= 0) shutdown(m_listen_fd, SHUT_RDWR);
+    m_listen_fd = -1;
+    for (int fd : m_conns) shutdown(fd, SHUT_RDWR);
+  }
+
+ private:
+  struct Connection {
+    Connection(int fd) : fd(fd) {}
+    ~Connection() { close(fd); }
+
+    int fd;
+    std::mutex write_mutex;  // Frames must not interleave
+  };
+
+  void serve(std::shared_ptr<Connection> conn) {
+    DataFrame frame;
+    while (data_plane_detail::read_frame(conn->fd, frame, m_max_data)) {
+      // Blocks when the workers are behind, the peer then stops sending
+      std::unique_lock lock(m_mutex);
+      m_cond.wait(lock, [this]() { return m_tasks.size() < m_max_queued; });
+      m_tasks.push_back({conn, std::move(frame)});
+      lock.unlock();
+      m_cond.notify_all();
+    }
+
+    std::lock_guard lock(m_conns_mutex);
+    m_conns.erase(conn->fd);
+    m_conns_cond.notify_all();
+  }
+
+  void work() {
+    while (true) {
+      std::unique_lock lock(m_mutex);
+      m_cond.wait(lock, [this]() { return m_stop || !m_tasks.empty(); });
+      if (m_tasks.empty()) return;
+      auto [conn, frame] = std::move(m_tasks.front());
+      m_tasks.pop_front();
+      lock.unlock();
+      m_cond.notify_all();
+
+      // Does not touch the server, it may answer after the server is gone
+      Respond respond = [conn, op = frame.op, stream = frame.stream](
+                            Payload payload, std::exception_ptr error) {
+        reply(*conn, op, stream, std::move(payload), error);
+      };
+      try {
+        m_handler(frame, respond);
+      } catch (...) {
+        respond(nullptr, std::current_exception());
+      }
+    }
+  }
+
+  static void reply(Connection& conn, DataOp op, uint32_t stream,
+                    Payload payload, std::exception_ptr error) {
+    DataStatus status = DataStatus::Ok;
+    if (error) {
+      try {
+        std::rethrow_exception(error);
+      } catch (const std::system_error& e) {
+        if (e.code() == std::errc::no_such_file_or_directory) {
+          status = DataStatus::NotFound;
+        } else if (e.code() == std::errc::resource_unavailable_try_again) {
+          status = DataStatus::Busy;
+        } else {
+          status = DataStatus::Error;
+        }
+        payload = std::make_shared<const std::string>(e.what());
+      } catch (const std::exception& e) {
+        status = DataStatus::Error;
+        payload = std::make_shared<const std::string>(e.what());
+      } catch (...) {
+        status = DataStatus::Error;
+        payload = nullptr;
+      }
+    }
+
+    std::lock_guard write_lock(conn.write_mutex);
+    if (!data_plane_detail::write_frame(conn.fd, op, status, stream, {},
+                                        payload ? payload->data() : nullptr,
+                                        payload ? payload->size() : 0)) {
+      shutdown(conn.fd, SHUT_RDWR);
+    }
+  }
+
+  struct Task {
+    std::shared_ptr<Connection> conn;
+    DataFrame frame;
+  };
+
+  Handler m_handler;
+  size_t m_max_queued;
+  uint64_t m_max_data;
+
+  std::mutex m_mutex;  // Guards m_tasks and m_stop
+  std::condition_variable m_cond;
+  std::deque<Task> m_tasks;
+  bool m_stop = false;
+  std::vector<std::thread> m_workers;
+
+  std::mutex m_conns_mutex;  // Guards m_listen_fd and m_conns
+  std::condition_variable m_conns_cond;
+  int m_listen_fd = -1;
+  std::unordered_set<int> m_conns;  // Connections with a running reader
+};
+
+/**
+ * Data plane client, a single persistent connection shared by every caller
+ *
+ * Calls block until their response arrives but do not wait for each other,
+ * except while their frame is being sent. A broken connection fails every
+ * call in flight and is reopened by the next call, as does a reply over
+ * `max_data` bytes.
+ */
+class DataPlaneClient {
+ public:
+  DataPlaneClient(std::string host, uint16_t port,
+                  uint64_t max_data = data_plane_detail::DEFAULT_MAX_DATA)
+      : m_host(std::move(host)), m_port(port), m_max_data(max_data) {}
+
+  ~DataPlaneClient() {
+    std::lock_guard write_lock(m_write_mutex);
+    if (m_fd >= 0) shutdown(m_fd, SHUT_RDWR);
+    if (m_reader.joinable()) m_reader.join();
+    if (m_fd >= 0) close(m_fd);
+  }
+
+  /**
+   * Store a partition, throws std::system_error with
+   * std::errc::resource_unavailable_try_again if the server is busy and
+   * std::runtime_error on other failures
+   */
+  void write(const std::string& name, const char* data, size_t size) {
+    check(call(DataOp::Write, name, data, size), name);
+  }
+
+  /**
+   * Get a partition, throws std::system_error with
+   * std::errc::no_such_file_or_directory if it does not exist, otherwise as
+   * write()
+   */
+  std::string read(const std::string& name) {
+    auto reply = call(DataOp::Read, name, nullptr, 0);
+    check(reply, name);
+    return std::move(reply.data);
+  }
+
+ private:
+  struct Reply {
+    DataStatus status;
+    std::string data;
+  };
+
+  static void check(const Reply& reply, const std::string& name) {
+    switch (reply.status) {
+      case DataStatus::Ok:
+        return;
+      case DataStatus::NotFound:
+        throw std::system_error(
+            std::make_error_code(std::errc::no_such_file_or_directory), name);
+      case DataStatus::Busy:
+        throw std::system_error(
+            std::make_error_code(std::errc::resource_unavailable_try_again),
+            name);
+      default:
+        throw std::runtime_error(reply.data);
+    }
+  }
+
+  Reply call(DataOp op, const std::string& name, const char* data,
+             size_t size) {
+    std::promise<Reply> promise;
+    auto future = promise.get_future();
+    {
+      std::lock_guard write_lock(m_write_mutex);
+      uint32_t stream;
+      {
+        std::lock_guard lock(m_mutex);
+        if (m_fd < 0 || m_broken) connect();
+        stream = m_next_stream++;
+        m_pending.emplace(stream, std::move(promise));
+      }
+
+      if (!data_plane_detail::write_frame(m_fd, op, DataStatus::Ok, stream,
+                                          name, data, size)) {
+        shutdown(m_fd, SHUT_RDWR);  // The reader fails every pending call
+      }
+    }
+    return future.get();
+  }
+
+  /**
+   * NOTE: Caller must hold m_write_mutex and m_mutex
+   */
+  void connect() {
+    // A broken connection's reader is done with m_mutex by now
+    if (m_reader.joinable()) m_reader.join();
+    if (m_fd >= 0) close(m_fd);
+    m_fd = -1;
+
+    addrinfo hints = {}, *addrs;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(m_host.c_str(), std::to_string(m_port).c_str(), &hints,
+                    &addrs) != 0) {
+      throw std::runtime_error("Cannot resolve data plane host " + m_host);
+    }
+
+    int fd = socket(addrs->ai_family, addrs->ai_socktype, 0);
+    bool ok = fd >= 0 && ::connect(fd, addrs->ai_addr, addrs->ai_addrlen) == 0;
+    freeaddrinfo(addrs);
+    if (!ok) {
+      if (fd >= 0) close(fd);
+      throw std::runtime_error("Cannot connect to data plane at " + m_host +
+                               ":" + std::to_string(m_port));
+    }
+
+    data_plane_detail::set_nodelay(fd);
+    m_fd = fd;
+    m_broken = false;
+    m_reader = std::thread([this, fd]() { read_replies(fd); });
+  }
+
+  void read_replies(int fd) {
+    DataFrame frame;
+    while (data_plane_detail::read_frame(fd, frame, m_max_data)) {
+      std::promise<Reply> promise;
+      {
+        std::lock_guard lock(m_mutex);
+        auto it = m_pending.find(frame.stream);
+        if (it == m_pending.end()) continue;
+        promise = std::move(it->second);
+        m_pending.erase(it);
+      }
+      promise.set_value({frame.status, std::move(frame.data)});
+    }
+
+    std::lock_guard lock(m_mutex);
+    for (auto& [stream, promise] : m_pending) {
+      promise.set_exception(std::make_exception_ptr(
+          std::runtime_error("Data plane connection lost")));
+    }
+    m_pending.clear();
+    m_broken = true;
+  }
+
+  std::string m_host;
+  uint16_t m_port;
+  uint64_t m_max_data;
+
+  std::mutex m_write_mutex;  // Guards sending and (re)connecting
+  std::mutex m_mutex;        // Guards m_pending, m_next_stream and m_broken
+  int m_fd = -1;
+  bool m_broken = false;
+  uint32_t m_next_stream = 0;
+  std::unordered_map<uint32_t, std::promise<Reply>> m_pending;
+  std::thread m_reader;
+};
+
+/**
+ * One data plane client per node, created on first use
+ */
+class DataPlaneClientPool {
+ public:
+  DataPlaneClient& get(const std::string& host, uint16_t port) {
+    std::lock_guard lock(m_mutex);
+    auto& client = m_clients[host + ":" + std::to_string(port)];
+    if (!client) {
+      client = std::make_unique<DataPlaneClient>(host, port, m_max_data);
+    }
+    return *client;
+  }
+
+  /**
+   * Largest reply accepted by the clients created from now on
+   */
+  void set_max_data(uint64_t max_data) {
+    std::lock_guard lock(m_mutex);
+    m_max_data = max_data;
+  }
+
+ private:
+  std::mutex m_mutex;  // Guards everything below
+  uint64_t m_max_data = data_plane_detail::DEFAULT_MAX_DATA;
+  std::unordered_map<std::string, std::unique_ptr<DataPlaneClient>> m_clients;
+};
@@ -0,0 +1,502 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#ifdef DFS_HAVE_IO_URING
+#include <liburing.h>
+#include <sys/eventfd.h>
+#endif
+
+/**
+ * Disk I/O for partitions
+ *
+ * Whole-partition reads and writes are handed to an engine, which keeps up to
+ * `queue_depth` of them in flight on the disk at once. The `_async` variants
+ * return right after submitting and call back from the engine's thread when
+ * the transfer completes, so the caller's thread is not held for the disk.
+ * read_file() and write_file() wait for the completion instead. Partitions
+ * of at least `direct_threshold` bytes bypass the page cache with O_DIRECT
+ * when `direct` is set, using buffers aligned to IO_ALIGNMENT.
+ *
+ * Errors are reported as std::system_error, a missing partition has the code
+ * std::errc::no_such_file_or_directory.
+ *
+ * NOTE: Callbacks run on the engine's thread and delay the completions behind
+ * them, they should only hand the result on (e.g. send it on a socket).
+ */
+class IOEngine {
+ public:
+  static const size_t IO_ALIGNMENT = 4096;
+
+  using ReadCallback =
+      std::function<void(std::string data, std::exception_ptr error)>;
+  using WriteCallback = std::function<void(std::exception_ptr error)>;
+
+  IOEngine(unsigned queue_depth, bool direct, uint64_t direct_threshold)
+      : m_direct(direct), m_direct_threshold(direct_threshold) {
+    // Nothing would ever be submitted and every transfer would hang
+    if (queue_depth < 1) {
+      throw std::invalid_argument("Queue depth must be at least 1");
+    }
+  }
+  virtual ~IOEngine() = default;
+
+  virtual const char* name() const = 0;
+
+  /**
+   * Read a partition, `done` gets its content or the error
+   */
+  void read_file_async(const std::filesystem::path& path, ReadCallback done) {
+    int fd = -1;
+    try {
+      fd = open_file(path, O_RDONLY, m_direct);
+      bool direct = m_direct;
+
+      struct stat st;
+      if (fstat(fd, &st) < 0) {
+        throw std::system_error(errno, std::system_category(), path);
+      }
+      size_t size = st.st_size;
+
+      if (direct && size < m_direct_threshold) {  // Not worth it
+        close(fd);
+        fd = -1;
+        fd = open_file(path, O_RDONLY, false);
+        direct = false;
+      }
+
+      if (direct) {
+        auto buffer = std::make_shared<AlignedBuffer>(align_up(size));
+        transfer(fd, false, buffer->get(), align_up(size), size,
+                 [fd, buffer, done](size_t n, std::exception_ptr error) {
+                   close(fd);
+                   if (error) return done({}, error);
+                   done(std::string(buffer->get(), n), nullptr);
+                 });
+      } else {
+        auto data = std::make_shared<std::string>(size, '\0');
+        transfer(fd, false, data->data(), size, size,
+                 [fd, data, done](size_t n, std::exception_ptr error) {
+                   close(fd);
+                   if (error) return done({}, error);
+                   data->resize(n);
+                   done(std::move(*data), nullptr);
+                 });
+      }
+    } catch (...) {
+      if (fd >= 0) close(fd);
+      done({}, std::current_exception());
+    }
+  }
+
+  /**
+   * Write a partition, `data` is kept alive until `done` is called
+   */
+  void write_file_async(const std::filesystem::path& path,
+                        std::shared_ptr<const std::string> data,
+                        WriteCallback done) {
+    int fd = -1;
+    try {
+      bool direct = m_direct && data->size() >= m_direct_threshold;
+      fd = open_file(path, O_WRONLY | O_CREAT | O_TRUNC, direct);
+
+      if (direct) {
+        // O_DIRECT only writes whole blocks, so pad and truncate afterwards
+        size_t size = data->size();
+        auto buffer = std::make_shared<AlignedBuffer>(align_up(size));
+        memcpy(buffer->get(), data->data(), size);
+        memset(buffer->get() + size, 0, align_up(size) - size);
+        transfer(fd, true, buffer->get(), align_up(size), align_up(size),
+                 [fd, buffer, size, path, done](size_t n,
+                                                std::exception_ptr error) {
+                   if (!error && ftruncate(fd, size) < 0) {
+                     error = std::make_exception_ptr(std::system_error(
+                         errno, std::system_category(), path));
+                   }
+                   close(fd);
+                   done(error);
+                 });
+      } else {
+        transfer(fd, true, const_cast<char*>(data->data()), data->size(),
+                 data->size(),
+                 [fd, data, done](size_t n, std::exception_ptr error) {
+                   close(fd);
+                   done(error);
+                 });
+      }
+    } catch (...) {
+      if (fd >= 0) close(fd);
+      done(std::current_exception());
+    }
+  }
+
+  std::string read_file(const std::filesystem::path& path) {
+    std::promise<std::string> promise;
+    read_file_async(path, [&promise](std::string data,
+                                     std::exception_ptr error) {
+      if (error) return promise.set_exception(error);
+      promise.set_value(std::move(data));
+    });
+    return promise.get_future().get();
+  }
+
+  void write_file(const std::filesystem::path& path, const std::string& data) {
+    std::promise<void> promise;
+    // Not owned, `data` outlives the wait below
+    std::shared_ptr<const std::string> view(std::shared_ptr<void>(), &data);
+    write_file_async(path, view, [&promise](std::exception_ptr error) {
+      if (error) return promise.set_exception(error);
+      promise.set_value();
+    });
+    promise.get_future().get();
+  }
+
+ protected:
+  using Completion = std::function<void(size_t done, std::exception_ptr)>;
+
+  /**
+   * A single read or write of up to `len` bytes from offset 0 of `fd`
+   *
+   * Engines resubmit short transfers until at least `min` bytes are done, and
+   * complete the request with the number of bytes transferred. A read stops
+   * early when it reaches the end of the file.
+   *
+   * NOTE: O_DIRECT reads ask for a whole number of blocks (`len`) but the file
+   * usually ends before that (`min`), resubmitting the tail would fail.
+   */
+  struct Request {
+    int fd;
+    bool is_write;
+    char* buf;
+    size_t len;
+    size_t min;
+    size_t done;
+    Completion complete;
+  };
+
+  virtual void submit(std::unique_ptr<Request> req) = 0;
+
+  void transfer(int fd, bool is_write, char* buf, size_t len, size_t min,
+                Completion complete) {
+    if (len == 0) return complete(0, nullptr);
+
+    submit(std::make_unique<Request>(
+        Request{fd, is_write, buf, len, min, 0, std::move(complete)}));
+  }
+
+  /**
+   * Call back with the result of `req`, `err` is an errno or 0
+   */
+  static void finish(Request& req, int err) {
+    std::exception_ptr error;
+    if (err != 0) {
+      error = std::make_exception_ptr(
+          std::system_error(err, std::system_category(), "Partition I/O"));
+    }
+
+    try {
+      req.complete(req.done, error);
+    } catch (const std::exception& e) {
+      // Nobody to report it to, and the engine thread must keep going
+      std::cerr << "Partition I/O callback failed: " << e.what() << std::endl;
+    }
+  }
+
+ private:
+  struct AlignedBuffer {
+    AlignedBuffer(size_t size)
+        : m_data((char*)std::aligned_alloc(IO_ALIGNMENT, size)) {
+      if (!m_data) throw std::bad_alloc();
+    }
+    ~AlignedBuffer() { std::free(m_data); }
+    char* get() { return m_data; }
+
+    char* m_data;
+  };
+
+  static size_t align_up(size_t size) {
+    size_t aligned = (size + IO_ALIGNMENT - 1) / IO_ALIGNMENT * IO_ALIGNMENT;
+    return aligned == 0 ? IO_ALIGNMENT : aligned;
+  }
+
+  static int open_file(const std::filesystem::path& path, int flags,
+                       bool direct) {
+    int fd = -1;
+    if (direct) fd = open(path.c_str(), flags | O_DIRECT, 0644);
+    // Some filesystems (e.g. tmpfs) do not support O_DIRECT
+    if (fd < 0) fd = open(path.c_str(), flags, 0644);
+    if (fd < 0) throw std::system_error(errno, std::system_category(), path);
+    return fd;
+  }
+
+  bool m_direct;
+  uint64_t m_direct_threshold;
+};
+
+/**
+ * Portable engine: blocking pread/pwrite on a pool of `queue_depth` threads
+ */
+class ThreadPoolIOEngine : public IOEngine {
+ public:
+  ThreadPoolIOEngine(unsigned queue_depth, bool direct,
+                     uint64_t direct_threshold)
+      : IOEngine(queue_depth, direct, direct_threshold) {
+    for (unsigned i = 0; i < queue_depth; i++) {
+      m_threads.emplace_back([this]() { run(); });
+    }
+  }
+
+  ~ThreadPoolIOEngine() {
+    {
+      std::lock_guard lock(m_mutex);
+      m_stop = true;
+    }
+    m_cond.notify_all();
+    for (auto& t : m_threads) t.join();
+  }
+
+  const char* name() const override { return "threads"; }
+
+ protected:
+  void submit(std::unique_ptr<Request> req) override {
+    {
+      std::lock_guard lock(m_mutex);
+      m_pending.push_back(std::move(req));
+    }
+    m_cond.notify_one();
+  }
+
+ private:
+  void run() {
+    while (true) {
+      std::unique_ptr<Request> req;
+      {
+        std::unique_lock lock(m_mutex);
+        m_cond.wait(lock, [this]() { return m_stop || !m_pending.empty(); });
+        if (m_pending.empty()) return;
+        req = std::move(m_pending.front());
+        m_pending.pop_front();
+      }
+
+      int err = 0;
+      while (req->done < req->min) {
+        ssize_t n = req->is_write ? pwrite(req->fd, req->buf + req->done,
+                                           req->len - req->done, req->done)
+                                  : pread(req->fd, req->buf + req->done,
+                                          req->len - req->done, req->done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+          err = errno;
+          break;
+        }
+        if (n == 0) break;  // End of file
+        req->done += n;
+      }
+
+      finish(*req, err);
+    }
+  }
+
+  std::mutex m_mutex;
+  std::condition_variable m_cond;
+  std::deque<std::unique_ptr<Request>> m_pending;
+  std::vector<std::thread> m_threads;
+  bool m_stop = false;
+};
+
+#ifdef DFS_HAVE_IO_URING
+/**
+ * io_uring engine
+ *
+ * A single thread owns the ring. Requests queued by request threads are
+ * turned into SQEs and submitted together with one syscall, and all
+ * available completions are reaped at once. The ring thread keeps a read
+ * pending on an eventfd so that new requests wake it up.
+ */
+class UringIOEngine : public IOEngine {
+ public:
+  UringIOEngine(unsigned queue_depth, bool direct, uint64_t direct_threshold)
+      : IOEngine(queue_depth, direct, direct_threshold),
+        m_queue_depth(queue_depth) {
+    // One more entry for the eventfd read
+    int ret = io_uring_queue_init(queue_depth + 1, &m_ring, 0);
+    if (ret < 0) {
+      throw std::system_error(-ret, std::system_category(), "io_uring");
+    }
+
+    m_eventfd = eventfd(0, EFD_CLOEXEC);
+    if (m_eventfd < 0) {
+      io_uring_queue_exit(&m_ring);
+      throw std::system_error(errno, std::system_category(), "eventfd");
+    }
+
+    m_thread = std::thread([this]() { run(); });
+  }
+
+  ~UringIOEngine() {
+    {
+      std::lock_guard lock(m_mutex);
+      m_stop = true;
+    }
+    wake();
+    m_thread.join();
+    io_uring_queue_exit(&m_ring);
+    close(m_eventfd);
+  }
+
+  const char* name() const override { return "io_uring"; }
+
+ protected:
+  void submit(std::unique_ptr<Request> req) override {
+    {
+      std::lock_guard lock(m_mutex);
+      m_pending.push_back(std::move(req));
+    }
+    wake();
+  }
+
+ private:
+  void wake() {
+    uint64_t one = 1;
+    while (write(m_eventfd, &one, sizeof one) < 0 && errno == EINTR) {
+    }
+  }
+
+  void arm_eventfd() {
+    io_uring_sqe* sqe = io_uring_get_sqe(&m_ring);
+    io_uring_prep_read(sqe, m_eventfd, &m_eventfd_buf, sizeof m_eventfd_buf,
+                       0);
+    io_uring_sqe_set_data(sqe, nullptr);
+  }
+
+  void prep(Request* req) {
+    io_uring_sqe* sqe = io_uring_get_sqe(&m_ring);
+    if (req->is_write) {
+      io_uring_prep_write(sqe, req->fd, req->buf + req->done,
+                          req->len - req->done, req->done);
+    } else {
+      io_uring_prep_read(sqe, req->fd, req->buf + req->done,
+                         req->len - req->done, req->done);
+    }
+    io_uring_sqe_set_data(sqe, req);
+  }
+
+  void run() {
+    bool stopping = false;
+    arm_eventfd();
+    io_uring_submit(&m_ring);
+
+    while (!stopping || m_inflight > 0) {
+      io_uring_cqe* cqe;
+      int ret = io_uring_wait_cqe(&m_ring, &cqe);
+      if (ret < 0 && ret != -EINTR) {
+        std::cerr << "io_uring_wait_cqe failed: " << strerror(-ret)
+                  << std::endl;
+        break;
+      }
+
+      // Reap every completion that is ready
+      unsigned head, count = 0;
+      io_uring_for_each_cqe(&m_ring, head, cqe) {
+        count++;
+        auto req = (Request*)io_uring_cqe_get_data(cqe);
+        if (req == nullptr) {
+          arm_eventfd();
+          continue;
+        }
+
+        m_inflight--;
+        if (cqe->res == -EINTR || cqe->res == -EAGAIN) {
+          m_retry.push_back(req);
+        } else if (cqe->res < 0) {
+          finish(*req, -cqe->res);
+          delete req;
+        } else if (cqe->res > 0 && req->done + cqe->res < req->min) {
+          req->done += cqe->res;  // Short transfer, submit the rest
+          m_retry.push_back(req);
+        } else {
+          req->done += cqe->res;
+          finish(*req, 0);
+          delete req;
+        }
+      }
+      io_uring_cq_advance(&m_ring, count);
+
+      {
+        std::lock_guard lock(m_mutex);
+        stopping = m_stop;
+        while (m_inflight < m_queue_depth &&
+               (!m_retry.empty() || !m_pending.empty())) {
+          Request* req;
+          if (!m_retry.empty()) {
+            req = m_retry.front();
+            m_retry.pop_front();
+          } else {
+            req = m_pending.front().release();
+            m_pending.pop_front();
+          }
+          prep(req);
+          m_inflight++;
+        }
+      }
+
+      // One syscall for the whole batch
+      io_uring_submit(&m_ring);
+    }
+  }
+
+  unsigned m_queue_depth;
+  io_uring m_ring;
+  int m_eventfd;
+  uint64_t m_eventfd_buf;
+  std::thread m_thread;
+
+  std::mutex m_mutex;
+  std::deque<std::unique_ptr<Request>> m_pending;
+  bool m_stop = false;
+
+  // Only touched by the ring thread
+  std::deque<Request*> m_retry;
+  unsigned m_inflight = 0;
+};
+#endif
+
+/**
+ * Get the best engine available on this machine
+ */
+inline std::unique_ptr<IOEngine> make_io_engine(unsigned queue_depth,
+                                                bool direct,
+                                                uint64_t direct_threshold) {
+#ifdef DFS_HAVE_IO_URING
+  try {
+    return std::make_unique<UringIOEngine>(queue_depth, direct,
+                                           direct_threshold);
+  } catch (const std::system_error& e) {
+    std::cerr << "io_uring is not available, falling back to threads: "
+              << e.what() << std::endl;
+  }
+#endif
+  return std::make_unique<ThreadPoolIOEngine>(queue_depth, direct,
+                                              direct_threshold);
+}
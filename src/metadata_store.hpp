@@ -0,0 +1,419 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "types.hpp"
+
+/**
+ * 128-bit binary partition ID
+ *
+ * Partitions are named by UUIDs on their agent, keeping the 16 raw bytes
+ * instead of the 36 character string saves a heap allocation per partition.
+ */
+struct PartitionId {
+  std::array<uint8_t, 16> bytes;
+
+  static PartitionId from_string(const std::string& uuid) {
+    PartitionId id{};
+    size_t n = 0;
+
+    for (size_t i = 0; i < uuid.size(); i++) {
+      if (uuid[i] == '-' && (i == 8 || i == 13 || i == 18 || i == 23)) {
+        continue;
+      }
+      if (n == 32) throw std::invalid_argument("Invalid partition ID " + uuid);
+
+      int d = hex_value(uuid[i]);
+      if (d < 0) throw std::invalid_argument("Invalid partition ID " + uuid);
+      id.bytes[n / 2] = (n % 2 == 0) ? d << 4 : id.bytes[n / 2] | d;
+      n++;
+    }
+
+    if (n != 32 || uuid.size() != 36) {
+      throw std::invalid_argument("Invalid partition ID " + uuid);
+    }
+
+    return id;
+  }
+
+  std::string to_string() const {
+    static const char* digits = "0123456789abcdef";
+    std::string uuid;
+    uuid.reserve(36);
+
+    for (size_t i = 0; i < bytes.size(); i++) {
+      if (i == 4 || i == 6 || i == 8 || i == 10) uuid.push_back('-');
+      uuid.push_back(digits[bytes[i] >> 4]);
+      uuid.push_back(digits[bytes[i] & 0xF]);
+    }
+
+    return uuid;
+  }
+
+ private:
+  static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+  }
+};
+
+struct CompactPartition {
+  PartitionId id;
+  uint32_t part_id;
+  uint32_t size;  // Partitions are at most --part-size bytes
+  uint16_t agent_id;
+};
+
+/**
+ * Stores the partitions of every file contiguously in large blocks
+ *
+ * A file owns a run of consecutive slots, rounded up to a power of two. Freed
+ * runs go to the free list of their size class, so they are reused by any
+ * file needing that many slots, and a file keeps its run while it is
+ * rewritten within the same class.
+ */
+class PartitionArena {
+ public:
+  struct Run {
+    uint32_t block;
+    uint32_t offset;
+    uint32_t count;
+  };
+
+  Run allocate(uint32_t count) {
+    if (count == 0) return {0, 0, 0};
+    size_t size_class = class_of(count);
+    uint32_t capacity = 1u << size_class;
+
+    auto& free = m_free[size_class];
+    if (!free.empty()) {
+      Run run = free.back();
+      free.pop_back();
+      m_free_slots -= capacity;
+      return {run.block, run.offset, count};
+    }
+
+    if (capacity > BLOCK_SIZE) {  // Huge file, give it its own block
+      m_blocks.push_back(std::make_unique<CompactPartition[]>(capacity));
+      m_capacity += capacity;
+      return {(uint32_t)m_blocks.size() - 1, 0, count};
+    }
+
+    if (m_blocks.empty() || m_used + capacity > BLOCK_SIZE) {
+      if (!m_blocks.empty()) release_tail();
+      m_blocks.push_back(std::make_unique<CompactPartition[]>(BLOCK_SIZE));
+      m_capacity += BLOCK_SIZE;
+      m_current = m_blocks.size() - 1;
+      m_used = 0;
+    }
+
+    Run run = {m_current, m_used, count};
+    m_used += capacity;
+    return run;
+  }
+
+  /**
+   * Give `run` room for `count` partitions, moving it only when its size
+   * class changes. The contents are not kept when it moves.
+   */
+  Run resize(const Run& run, uint32_t count) {
+    if (run.count > 0 && count > 0 && class_of(run.count) == class_of(count)) {
+      return {run.block, run.offset, count};
+    }
+    release(run);
+    return allocate(count);
+  }
+
+  void release(const Run& run) {
+    if (run.count == 0) return;
+    size_t size_class = class_of(run.count);
+    m_free[size_class].push_back({run.block, run.offset, 1u << size_class});
+    m_free_slots += 1u << size_class;
+  }
+
+  CompactPartition* get(const Run& run) {
+    return run.count == 0 ? nullptr : &m_blocks[run.block][run.offset];
+  }
+
+  const CompactPartition* get(const Run& run) const {
+    return run.count == 0 ? nullptr : &m_blocks[run.block][run.offset];
+  }
+
+  /**
+   * Slots in free runs, waiting to be reused
+   */
+  uint64_t free_slots() const { return m_free_slots; }
+
+  uint64_t memory_usage() const {
+    uint64_t free_runs = 0;
+    for (auto& free : m_free) free_runs += free.capacity();
+    return m_capacity * sizeof(CompactPartition) + free_runs * sizeof(Run);
+  }
+
+ private:
+  static const uint32_t BLOCK_SIZE = 1 << 16;  // Partitions per block
+
+  /**
+   * Index of the smallest power of two holding `count` slots
+   */
+  static size_t class_of(uint32_t count) { return std::bit_width(count - 1); }
+
+  /**
+   * Hand the unused end of the current block to the free lists, largest
+   * classes first, so smaller runs can still be carved from it
+   */
+  void release_tail() {
+    while (m_used < BLOCK_SIZE) {
+      uint32_t capacity = std::bit_floor(BLOCK_SIZE - m_used);
+      m_free[class_of(capacity)].push_back({m_current, m_used, capacity});
+      m_free_slots += capacity;
+      m_used += capacity;
+    }
+  }
+
+  std::vector<std::unique_ptr<CompactPartition[]>> m_blocks;
+  uint32_t m_current = 0;  // Block new runs are carved from
+  uint32_t m_used = 0;     // Slots used in the current block
+  uint64_t m_capacity = 0;
+  uint64_t m_free_slots = 0;
+  std::array<std::vector<Run>, 33> m_free;  // Size class -> free runs
+};
+
+/**
+ * Reference counted pool of file names
+ *
+ * Directory entries only hold a view of the pooled name, so a name shared by
+ * many files (e.g. `config.yaml`) is stored once.
+ */
+class NamePool {
+ public:
+  std::string_view intern(std::string_view name) {
+    auto it = m_names.find(name);
+    if (it == m_names.end()) {
+      it = m_names.emplace(std::string(name), 0).first;
+      m_bytes += name.size() > 15 ? name.size() + 1 : 0;  // Beyond SSO
+    }
+
+    it->second++;
+    return it->first;  // Nodes never move, so the view stays valid
+  }
+
+  void release(std::string_view name) {
+    auto it = m_names.find(name);
+    if (it == m_names.end() || --it->second > 0) return;
+
+    m_bytes -= name.size() > 15 ? name.size() + 1 : 0;
+    m_names.erase(it);
+  }
+
+  uint64_t memory_usage() const {
+    // Node: next pointer, key, refcount and cached hash
+    return m_names.size() * (sizeof(void*) + sizeof(std::string) +
+                             sizeof(uint64_t) + sizeof(size_t)) +
+           m_names.bucket_count() * sizeof(void*) + m_bytes;
+  }
+
+ private:
+  struct Hash {
+    using is_transparent = void;
+    size_t operator()(std::string_view s) const {
+      return std::hash<std::string_view>{}(s);
+    }
+  };
+
+  std::unordered_map<std::string, uint64_t, Hash, std::equal_to<>> m_names;
+  uint64_t m_bytes = 0;  // Heap bytes of long names
+};
+
+/**
+ * Compact in-memory storage of file metadata, indexed by inode number
+ *
+ * Inode numbers are handed out sequentially, so records live in a deque
+ * indexed by inode instead of a hash map. Paths are not stored at all, the
+ * namespace tree only keeps the (pooled) last component of each path.
+ */
+class MetadataStore {
+ public:
+  bool contains(uint64_t inode) const {
+    return inode < m_files.size() && (m_files[inode].flags & EXISTS);
+  }
+
+  /**
+   * Get the metadata of a file, filepath is left empty
+   *
+   * Partitions and inline data are skipped unless `with_data` is set
+   */
+  FileMetadata get(uint64_t inode, bool with_data = true) const {
+    if (!contains(inode)) throw std::out_of_range("No such inode");
+    auto& file = m_files[inode];
+
+    FileMetadata m;
+    m.inode_number = inode;
+    m.filetype = file.filetype;
+    m.size = file.size;
+    m.uid = file.uid;
+    m.gid = file.gid;
+    m.perm_flags = file.perm_flags;
+    m.is_inline = file.flags & INLINE;
+    if (!with_data) return m;
+
+    if (m.is_inline) m.inline_data = m_inline.at(inode);
+
+    auto parts = m_arena.get(file.partitions);
+    m.partitions.reserve(file.partitions.count);
+    for (uint32_t i = 0; i < file.partitions.count; i++) {
+      m.partitions.push_back({parts[i].part_id, parts[i].agent_id,
+                              parts[i].id.to_string(), parts[i].size});
+    }
+
+    return m;
+  }
+
+  void put(const FileMetadata& m) {
+    if (m.inode_number >= m_files.size()) m_files.resize(m.inode_number + 1);
+    auto& file = m_files[m.inode_number];
+
+    file.filetype = m.filetype;
+    file.size = m.size;
+    file.uid = m.uid;
+    file.gid = m.gid;
+    file.perm_flags = m.perm_flags;
+    file.flags = EXISTS | (m.is_inline ? INLINE : 0);
+
+    if (m.is_inline) {
+      m_inline[m.inode_number] = m.inline_data;
+    } else {
+      m_inline.erase(m.inode_number);
+    }
+
+    auto old = m_arena.get(file.partitions);
+    for (uint32_t i = 0; i < file.partitions.count; i++) {
+      m_agent_bytes[old[i].agent_id] -= old[i].size;
+    }
+
+    file.partitions = m_arena.resize(file.partitions, m.partitions.size());
+    auto parts = m_arena.get(file.partitions);
+    for (size_t i = 0; i < m.partitions.size(); i++) {
+      auto& p = m.partitions[i];
+      parts[i] = {PartitionId::from_string(p.filepath), (uint32_t)p.part_id,
+                  (uint32_t)p.size, p.agent_id};
+      m_agent_bytes[p.agent_id] += p.size;
+    }
+  }
+
+  /**
+   * Bytes referenced on each agent, kept up to date by put() and
+   * move_partition()
+   */
+  const std::unordered_map<uint16_t, uint64_t>& agent_bytes() const {
+    return m_agent_bytes;
+  }
+
+  /**
+   * One past the highest inode, for scanning the store in chunks
+   */
+  uint64_t inode_end() const { return m_files.size(); }
+
+  /**
+   * Call `fn(inode, partition)` for the partitions of the files in
+   * [first, last), until it returns false
+   *
+   * Scanning in chunks lets callers release their lock in between.
+   */
+  template <class F>
+  void scan_partitions(F fn, uint64_t first, uint64_t last) const {
+    last = std::min<uint64_t>(last, m_files.size());
+    for (uint64_t inode = first; inode < last; inode++) {
+      auto& file = m_files[inode];
+      if (!(file.flags & EXISTS)) continue;
+
+      auto parts = m_arena.get(file.partitions);
+      for (uint32_t i = 0; i < file.partitions.count; i++) {
+        if (!fn(inode, (const CompactPartition&)parts[i])) return;
+      }
+    }
+  }
+
+  /**
+   * Point a partition to another agent, if it still is on `from`
+   */
+  bool move_partition(uint64_t inode, uint64_t part_id, const PartitionId& id,
+                      uint16_t from, uint16_t to) {
+    if (!contains(inode)) return false;
+    auto& file = m_files[inode];
+
+    auto parts = m_arena.get(file.partitions);
+    for (uint32_t i = 0; i < file.partitions.count; i++) {
+      if (parts[i].part_id == part_id && parts[i].id.bytes == id.bytes &&
+          parts[i].agent_id == from) {
+        parts[i].agent_id = to;
+        m_agent_bytes[from] -= parts[i].size;
+        m_agent_bytes[to] += parts[i].size;
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  NamePool& names() { return m_names; }
+
+  /**
+   * Estimated memory used by the metadata, per component
+   */
+  json memory_usage() const {
+    uint64_t files = 0, partitions = 0, inline_bytes = 0;
+    for (auto& file : m_files) {
+      if (!(file.flags & EXISTS)) continue;
+      files++;
+      partitions += file.partitions.count;
+    }
+    for (auto& [inode, data] : m_inline) {
+      // Node: next pointer, key, string and cached hash
+      inline_bytes += sizeof(void*) * 2 + sizeof(uint64_t) +
+                      sizeof(std::string) +
+                      (data.size() > 15 ? data.size() + 1 : 0);
+    }
+
+    json j = json::object();
+    j["files"] = files;
+    j["partitions"] = partitions;
+    j["file_bytes"] = m_files.size() * sizeof(CompactFile);
+    j["partition_bytes"] = m_arena.memory_usage();
+    j["inline_bytes"] = inline_bytes;
+    j["name_bytes"] = m_names.memory_usage();
+    return j;
+  }
+
+ private:
+  static const uint8_t EXISTS = 1;
+  static const uint8_t INLINE = 2;
+
+  struct CompactFile {
+    uint64_t size = 0;
+    uint32_t uid = 0;  // uid_t and gid_t are 32 bits
+    uint32_t gid = 0;
+    PartitionArena::Run partitions = {0, 0, 0};
+    uint16_t perm_flags = 0;
+    FileType filetype = FileType::None;
+    uint8_t flags = 0;
+  };
+
+  std::deque<CompactFile> m_files;
+  PartitionArena m_arena;
+  std::unordered_map<uint64_t, std::string> m_inline;
+  NamePool m_names;
+  std::unordered_map<uint16_t, uint64_t> m_agent_bytes;
+};
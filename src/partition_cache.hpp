@@ -0,0 +1,187 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <unordered_map>
+
+using json = nlohmann::json;
+
+/**
+ * In-memory cache of partitions, keyed by partition UUID
+ *
+ * Partitions are never modified after they are written (a rewrite creates new
+ * UUIDs), so entries never need to be invalidated.
+ *
+ * Each shard uses S3-FIFO: new entries go to a small FIFO and are only
+ * promoted to the main FIFO if they are read again before falling out of it.
+ * Keys evicted from the small FIFO are remembered in a ghost FIFO, so they go
+ * straight to the main FIFO when they come back. One-off scans therefore only
+ * churn the small FIFO and do not flush the popular partitions.
+ *
+ * Every shard gets an equal part of the capacity, a partition larger than
+ * 1/NUM_SHARDS of it is never cached.
+ */
+class PartitionCache {
+ public:
+  using Data = std::shared_ptr<const std::string>;
+
+  static const size_t NUM_SHARDS = 16;
+
+  PartitionCache(uint64_t capacity) {
+    for (auto& shard : m_shards) shard.set_capacity(capacity / NUM_SHARDS);
+  }
+
+  /**
+   * Get a partition, returns nullptr on miss
+   */
+  Data get(const std::string& key) {
+    Data data = shard_of(key).get(key);
+    if (data) {
+      m_hits++;
+    } else {
+      m_misses++;
+    }
+    return data;
+  }
+
+  void put(const std::string& key, Data data) {
+    shard_of(key).put(key, std::move(data));
+  }
+
+  json stats() const {
+    uint64_t hits = m_hits, misses = m_misses, size = 0, capacity = 0;
+    for (auto& shard : m_shards) {
+      std::lock_guard lock(shard.m_mutex);
+      size += shard.m_small_size + shard.m_main_size;
+      capacity += shard.m_capacity;
+    }
+
+    json j = json::object();
+    j["hits"] = hits;
+    j["misses"] = misses;
+    j["hit_rate"] = hits + misses == 0 ? 0.0 : (double)hits / (hits + misses);
+    j["size"] = size;
+    j["capacity"] = capacity;
+    return j;
+  }
+
+ private:
+  static const uint8_t MAX_FREQ = 3;
+
+  struct Entry {
+    Data data;
+    uint8_t freq;
+  };
+
+  struct Shard {
+    void set_capacity(uint64_t capacity) {
+      m_capacity = capacity;
+      m_small_capacity = capacity / 10;
+    }
+
+    Data get(const std::string& key) {
+      std::lock_guard lock(m_mutex);
+      auto it = m_entries.find(key);
+      if (it == m_entries.end()) return nullptr;
+
+      if (it->second.freq < MAX_FREQ) it->second.freq++;
+      return it->second.data;
+    }
+
+    void put(const std::string& key, Data data) {
+      std::lock_guard lock(m_mutex);
+      if (data->size() > m_capacity || m_entries.contains(key)) return;
+
+      bool in_main = false;
+      auto ghost = m_ghosts_idx.find(key);
+      if (ghost != m_ghosts_idx.end()) {  // Evicted recently, so it is popular
+        m_ghosts.erase(ghost->second);
+        m_ghosts_idx.erase(ghost);
+        in_main = true;
+      }
+
+      while (m_small_size + m_main_size + data->size() > m_capacity) evict();
+
+      auto& queue = in_main ? m_main : m_small;
+      queue.push_front(key);
+      (in_main ? m_main_size : m_small_size) += data->size();
+      m_entries[key] = {std::move(data), 0};
+    }
+
+    void evict() {
+      if (m_small_size > m_small_capacity || m_main.empty()) {
+        evict_small();
+      } else {
+        evict_main();
+      }
+    }
+
+    void evict_small() {
+      auto key = m_small.back();
+      m_small.pop_back();
+      auto& entry = m_entries[key];
+      m_small_size -= entry.data->size();
+
+      if (entry.freq > 1) {  // Read again while in the small FIFO
+        m_main.push_front(key);
+        m_main_size += entry.data->size();
+        entry.freq = 0;
+        return;
+      }
+
+      m_ghosts.push_front(key);
+      m_ghosts_idx[key] = m_ghosts.begin();
+      if (m_ghosts.size() > m_entries.size()) {
+        m_ghosts_idx.erase(m_ghosts.back());
+        m_ghosts.pop_back();
+      }
+      m_entries.erase(key);
+    }
+
+    void evict_main() {
+      while (true) {
+        auto key = m_main.back();
+        m_main.pop_back();
+        auto& entry = m_entries[key];
+
+        if (entry.freq > 0) {  // Give it another round
+          entry.freq--;
+          m_main.push_front(key);
+          continue;
+        }
+
+        m_main_size -= entry.data->size();
+        m_entries.erase(key);
+        return;
+      }
+    }
+
+    mutable std::mutex m_mutex;
+    uint64_t m_capacity = 0;
+    uint64_t m_small_capacity = 0;
+    uint64_t m_small_size = 0;
+    uint64_t m_main_size = 0;
+
+    std::unordered_map<std::string, Entry> m_entries;
+    std::list<std::string> m_small;
+    std::list<std::string> m_main;
+    std::list<std::string> m_ghosts;
+    std::unordered_map<std::string, std::list<std::string>::iterator>
+        m_ghosts_idx;
+  };
+
+  Shard& shard_of(const std::string& key) {
+    return m_shards[std::hash<std::string>{}(key) % NUM_SHARDS];
+  }
+
+  std::array<Shard, NUM_SHARDS> m_shards;
+  std::atomic<uint64_t> m_hits = 0;
+  std::atomic<uint64_t> m_misses = 0;
+};
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+/**
+ * Limits background work to `rate` units (usually bytes) per second
+ *
+ * Every caller reserves the next free time slot for its amount of work and
+ * sleeps until it starts, so concurrent callers share the rate. A rate of 0
+ * means no limit.
+ */
+class RateLimiter {
+ public:
+  RateLimiter(uint64_t rate) : m_rate(rate) {}
+
+  void acquire(uint64_t amount) {
+    if (m_rate == 0) return;
+
+    std::unique_lock lock(m_mutex);
+    auto now = std::chrono::steady_clock::now();
+    if (m_next < now) m_next = now;
+
+    auto start = m_next;
+    m_next += std::chrono::nanoseconds(amount * 1000000000 / m_rate);
+    lock.unlock();
+
+    std::this_thread::sleep_until(start);
+  }
+
+ private:
+  uint64_t m_rate;
+  std::mutex m_mutex;
+  std::chrono::steady_clock::time_point m_next;
+};
@@ -0,0 +1,329 @@
+#pragma once
+
+#include <httplib.h>
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+using json = nlohmann::json;
+
+/**
+ * Histogram of queueing delays, in power of two buckets of microseconds
+ */
+class DelayHistogram {
+ public:
+  void record(std::chrono::steady_clock::duration delay) {
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(delay);
+    size_t bucket = std::bit_width((uint64_t)std::max<int64_t>(us.count(), 0));
+    m_buckets[std::min(bucket, m_buckets.size() - 1)]++;
+    m_count++;
+  }
+
+  /**
+   * Upper bound of the `p` quantile in milliseconds
+   */
+  double percentile(double p) const {
+    uint64_t count = 0;
+    for (size_t i = 0; i < m_buckets.size(); i++) {
+      count += m_buckets[i];
+      if (count > 0 && count >= p * m_count) return (1ull << i) / 1000.0;
+    }
+    return 0;
+  }
+
+  json stats() const {
+    json j = json::object();
+    j["count"] = m_count;
+    j["p50_ms"] = percentile(0.5);
+    j["p99_ms"] = percentile(0.99);
+    return j;
+  }
+
+ private:
+  std::array<uint64_t, 40> m_buckets = {};
+  uint64_t m_count = 0;
+};
+
+enum class Priority : uint8_t { Interactive, Bulk, Background, Peer };
+
+/**
+ * Admission control of requests by priority class
+ *
+ * At most `max_running` requests run at once, and each class has its own
+ * concurrency limit on top. Interactive requests (client reads, metadata) go
+ * first, then bulk transfers (uploads), then background work (rebalancing,
+ * garbage collection). A lower class only starts when no higher class that
+ * could run is waiting, so bulk traffic never takes a free slot from a read.
+ *
+ * Peer requests (partition transfers from the CMMU and other agents) have
+ * their own slots on top of `max_running`. A client read or upload holds its
+ * slot while its partitions move between nodes, so if those transfers
+ * competed for the same slots, agents could all wait on one another.
+ *
+ * Requests past `max_queued` waiting in their class, or that wait longer than
+ * `max_delay`, are shed and should be answered with 503. Waiting requests hold
+ * a connection thread, so at most `max_queued_lower` requests of all the
+ * classes but Interactive wait at once: a burst of uploads cannot take every
+ * thread and leave new reads stuck behind it before they are even parsed.
+ */
+class RequestScheduler {
+ public:
+  static const size_t NUM_PRIORITIES = 4;
+
+  /**
+   * Held while a request runs, the slot is freed when the last copy goes
+   */
+  class Ticket {
+   public:
+    Ticket(RequestScheduler& scheduler, Priority priority)
+        : m_scheduler(scheduler), m_priority(priority) {}
+    ~Ticket() { m_scheduler.release(m_priority); }
+
+   private:
+    RequestScheduler& m_scheduler;
+    Priority m_priority;
+  };
+
+  RequestScheduler(unsigned max_running,
+                   std::array<unsigned, NUM_PRIORITIES> limits,
+                   size_t max_queued, size_t max_queued_lower,
+                   std::chrono::milliseconds max_delay)
+      : m_max_running(max_running),
+        m_max_queued(max_queued),
+        m_max_queued_lower(max_queued_lower),
+        m_max_delay(max_delay) {
+    if (max_running < 1) {
+      throw std::invalid_argument("max_running must be at least 1");
+    }
+    for (size_t i = 0; i < NUM_PRIORITIES; i++) {
+      if (limits[i] < 1) {
+        throw std::invalid_argument("Class limits must be at least 1");
+      }
+      m_classes[i].limit = (Priority)i == Priority::Peer
+                               ? limits[i]
+                               : std::min(limits[i], max_running);
+    }
+  }
+
+  /**
+   * Wait for a slot, returns nullptr if the request is shed
+   */
+  std::shared_ptr<Ticket> admit(Priority priority) {
+    auto start = std::chrono::steady_clock::now();
+    auto& c = m_classes[(size_t)priority];
+
+    std::unique_lock lock(m_mutex);
+    if (!can_start(priority)) {
+      bool lower = priority != Priority::Interactive;
+      if (c.queued >= m_max_queued ||
+          (lower && m_queued_lower >= m_max_queued_lower)) {
+        c.shed++;
+        return nullptr;
+      }
+
+      c.queued++;
+      if (lower) m_queued_lower++;
+      bool admitted = m_cond.wait_until(lock, start + m_max_delay, [&]() {
+        return can_start(priority);
+      });
+      c.queued--;
+      if (lower) m_queued_lower--;
+      m_cond.notify_all();  // Lower classes may have been waiting on us
+
+      if (!admitted) {
+        c.shed++;
+        return nullptr;
+      }
+    }
+
+    return start_locked(priority, start);
+  }
+
+  /**
+   * Take a slot only if one is free now, returns nullptr otherwise
+   *
+   * For callers that must not block, e.g. a fixed pool of workers.
+   */
+  std::shared_ptr<Ticket> try_admit(Priority priority) {
+    std::lock_guard lock(m_mutex);
+    if (!can_start(priority)) {
+      m_classes[(size_t)priority].shed++;
+      return nullptr;
+    }
+    return start_locked(priority, std::chrono::steady_clock::now());
+  }
+
+  json stats() const {
+    static const char* names[] = {"interactive", "bulk", "background",
+                                  "peer"};
+    std::lock_guard lock(m_mutex);
+
+    json j = json::object();
+    j["running"] = m_running;
+    j["max_running"] = m_max_running;
+    j["queued_lower"] = m_queued_lower;
+    for (size_t i = 0; i < NUM_PRIORITIES; i++) {
+      auto& c = m_classes[i];
+      json j_class = json::object();
+      j_class["limit"] = c.limit;
+      j_class["running"] = c.running;
+      j_class["queued"] = c.queued;
+      j_class["admitted"] = c.admitted;
+      j_class["shed"] = c.shed;
+      j_class["queue_delay"] = c.delay.stats();
+      j[names[i]] = j_class;
+    }
+    return j;
+  }
+
+ private:
+  struct Class {
+    unsigned limit = 0;
+    unsigned running = 0;
+    size_t queued = 0;
+    uint64_t admitted = 0;
+    uint64_t shed = 0;
+    DelayHistogram delay;
+  };
+
+  /**
+   * NOTE: Caller must hold m_mutex
+   */
+  std::shared_ptr<Ticket> start_locked(
+      Priority priority, std::chrono::steady_clock::time_point start) {
+    auto& c = m_classes[(size_t)priority];
+    c.running++;
+    if (priority != Priority::Peer) m_running++;
+    c.admitted++;
+    c.delay.record(std::chrono::steady_clock::now() - start);
+    return std::make_shared<Ticket>(*this, priority);
+  }
+
+  /**
+   * NOTE: Caller must hold m_mutex
+   */
+  bool can_start(Priority priority) const {
+    auto& c = m_classes[(size_t)priority];
+    if (priority == Priority::Peer) return c.running < c.limit;
+    if (m_running >= m_max_running || c.running >= c.limit) return false;
+
+    for (size_t i = 0; i < (size_t)priority; i++) {
+      auto& higher = m_classes[i];
+      if (higher.queued > 0 && higher.running < higher.limit) return false;
+    }
+    return true;
+  }
+
+  void release(Priority priority) {
+    {
+      std::lock_guard lock(m_mutex);
+      m_classes[(size_t)priority].running--;
+      if (priority != Priority::Peer) m_running--;
+    }
+    m_cond.notify_all();
+  }
+
+  unsigned m_max_running;
+  size_t m_max_queued;
+  size_t m_max_queued_lower;
+  std::chrono::milliseconds m_max_delay;
+
+  mutable std::mutex m_mutex;  // Guards everything below
+  std::condition_variable m_cond;
+  unsigned m_running = 0;
+  size_t m_queued_lower = 0;  // Waiting in every class but Interactive
+  std::array<Class, NUM_PRIORITIES> m_classes;
+};
+
+/**
+ * Task queue for httplib::Server (see `new_task_queue`)
+ *
+ * httplib queues whole connections before their requests are parsed, so
+ * priorities are applied by RequestScheduler once the route is known. This
+ * pool only bounds the connections waiting for a thread: past `max_pending`
+ * new connections are refused instead of piling up behind the others.
+ */
+class ConnectionTaskQueue : public httplib::TaskQueue {
+ public:
+  ConnectionTaskQueue(size_t threads, size_t max_pending)
+      : m_max_pending(max_pending) {
+    for (size_t i = 0; i < threads; i++) {
+      m_threads.emplace_back([this]() { run(); });
+    }
+  }
+
+  bool enqueue(std::function<void()> fn) override {
+    {
+      std::lock_guard lock(m_mutex);
+      if (m_shutdown || m_pending.size() >= m_max_pending) {
+        m_rejected++;
+        return false;
+      }
+      m_pending.push_back({std::move(fn), std::chrono::steady_clock::now()});
+    }
+    m_cond.notify_one();
+    return true;
+  }
+
+  void shutdown() override {
+    {
+      std::lock_guard lock(m_mutex);
+      m_shutdown = true;
+    }
+    m_cond.notify_all();
+    for (auto& t : m_threads) t.join();
+  }
+
+  json stats() const {
+    std::lock_guard lock(m_mutex);
+    json j = json::object();
+    j["threads"] = m_threads.size();
+    j["pending"] = m_pending.size();
+    j["rejected"] = m_rejected;
+    j["queue_delay"] = m_delay.stats();
+    return j;
+  }
+
+ private:
+  struct Task {
+    std::function<void()> fn;
+    std::chrono::steady_clock::time_point time;
+  };
+
+  void run() {
+    while (true) {
+      std::unique_lock lock(m_mutex);
+      m_cond.wait(lock, [this]() { return m_shutdown || !m_pending.empty(); });
+      if (m_pending.empty()) return;  // Shutting down and drained
+
+      auto task = std::move(m_pending.front());
+      m_pending.pop_front();
+      m_delay.record(std::chrono::steady_clock::now() - task.time);
+      lock.unlock();
+
+      task.fn();
+    }
+  }
+
+  size_t m_max_pending;
+  std::vector<std::thread> m_threads;
+
+  mutable std::mutex m_mutex;  // Guards everything below
+  std::condition_variable m_cond;
+  std::deque<Task> m_pending;
+  bool m_shutdown = false;
+  uint64_t m_rejected = 0;
+  DelayHistogram m_delay;
+};
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <nlohmann/json.hpp>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+using json = nlohmann::json;
+
+struct ShardInfo {
+  std::string address;
+  uint16_t port;
+};
+
+inline void to_json(json& j, const ShardInfo& s) {
+  j = json{{"address", s.address}, {"port", s.port}};
+}
+
+inline void from_json(const json& j, ShardInfo& s) {
+  j.at("address").get_to(s.address);
+  j.at("port").get_to(s.port);
+}
+
+/**
+ * Maps paths to the CMMU shard owning them
+ *
+ * The namespace is split by top-level entry: `/a/b/c` belongs to the shard
+ * owning `a`, so a whole subtree lives on one shard and directory listings
+ * and renames inside it stay local. Top-level names are placed with
+ * consistent hashing (VIRTUAL_NODES points per shard on a ring), so adding a
+ * shard only moves about 1/n of them.
+ *
+ * NOTE: A single top-level directory holding everything lands on one shard,
+ * sharding only helps namespaces with many top-level names.
+ *
+ * An empty map means there is a single, unsharded CMMU.
+ */
+class ShardMap {
+ public:
+  ShardMap() = default;
+
+  ShardMap(std::vector<ShardInfo> shards) : m_shards(std::move(shards)) {
+    for (size_t i = 0; i < m_shards.size(); i++) {
+      for (unsigned v = 0; v < VIRTUAL_NODES; v++) {
+        std::string point = std::to_string(i) + "#" + std::to_string(v);
+        m_ring.push_back({hash(point), i});
+      }
+    }
+    std::sort(m_ring.begin(), m_ring.end());
+  }
+
+  /**
+   * Parse a comma separated list of host:port
+   */
+  static ShardMap parse(const std::string& list) {
+    std::vector<ShardInfo> shards;
+    size_t start = 0;
+
+    while (start < list.size()) {
+      size_t end = list.find(',', start);
+      if (end == std::string::npos) end = list.size();
+
+      std::string shard = list.substr(start, end - start);
+      size_t colon = shard.rfind(':');
+      if (colon == std::string::npos) {
+        throw std::invalid_argument("Shard is not host:port: " + shard);
+      }
+      shards.push_back({shard.substr(0, colon),
+                        (uint16_t)std::stoul(shard.substr(colon + 1))});
+      start = end + 1;
+    }
+
+    return ShardMap(shards);
+  }
+
+  bool empty() const { return m_shards.empty(); }
+  size_t size() const { return m_shards.size(); }
+  const std::vector<ShardInfo>& shards() const { return m_shards; }
+
+  /**
+   * Get the index of the shard owning a path
+   *
+   * The root directory exists on every shard, it is reported as shard 0
+   */
+  size_t owner(const std::string& filepath) const {
+    if (m_shards.empty()) return 0;
+
+    std::string_view name = top_level(filepath);
+    if (name.empty()) return 0;
+
+    uint64_t h = hash(name);
+    auto it = std::lower_bound(m_ring.begin(), m_ring.end(),
+                               std::make_pair(h, (size_t)0));
+    if (it == m_ring.end()) it = m_ring.begin();
+    return it->second;
+  }
+
+  static bool is_root(const std::string& filepath) {
+    return top_level(filepath).empty();
+  }
+
+ private:
+  static const unsigned VIRTUAL_NODES = 160;
+
+  static std::string_view top_level(std::string_view filepath) {
+    size_t start = filepath.find_first_not_of('/');
+    if (start == std::string_view::npos) return {};
+    size_t end = filepath.find('/', start);
+    if (end == std::string_view::npos) end = filepath.size();
+    return filepath.substr(start, end - start);
+  }
+
+  // FNV-1a with a final mix, every CMMU and agent must agree on it
+  static uint64_t hash(std::string_view s) {
+    uint64_t h = 14695981039346656037ull;
+    for (unsigned char c : s) {
+      h ^= c;
+      h *= 1099511628211ull;
+    }
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    return h;
+  }
+
+  std::vector<ShardInfo> m_shards;
+  std::vector<std::pair<uint64_t, size_t>> m_ring;  // Hash -> shard index
+};
@@ -25,6 +25,7 @@ struct FileMetadata {
     uint64_t part_id;      // ID of the partition, unique within a file
     uint16_t agent_id;     // ID of the node containing the partition
     std::string filepath;  // filepath on the node
+    uint64_t size;         // In bytes
   };
 
   std::string filepath;  // Absolute filepath of this DFS
@@ -37,18 +38,82 @@ struct FileMetadata {
   uint16_t perm_flags;  // oooogggguuuu____
 
   std::vector<Partition> partitions;
+
+  // Small files are kept directly in the metadata instead of on agents
+  bool is_inline = false;
+  std::string inline_data;
 };
 
+/**
+ * Base64 helpers, used to carry binary inline data inside JSON strings
+ */
+inline std::string base64_encode(const std::string& in) {
+  static const char* table =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string out;
+  out.reserve((in.size() + 2) / 3 * 4);
+
+  uint32_t val = 0;
+  int bits = -6;
+  for (unsigned char c : in) {
+    val = (val << 8) + c;
+    bits += 8;
+    while (bits >= 0) {
+      out.push_back(table[(val >> bits) & 0x3F]);
+      bits -= 6;
+    }
+  }
+  if (bits > -6) out.push_back(table[((val << 8) >> (bits + 8)) & 0x3F]);
+  while (out.size() % 4) out.push_back('=');
+
+  return out;
+}
+
+inline std::string base64_decode(const std::string& in) {
+  std::string out;
+  out.reserve(in.size() / 4 * 3);
+
+  uint32_t val = 0;
+  int bits = -8;
+  for (unsigned char c : in) {
+    int d;
+    if (c >= 'A' && c <= 'Z') {
+      d = c - 'A';
+    } else if (c >= 'a' && c <= 'z') {
+      d = c - 'a' + 26;
+    } else if (c >= '0' && c <= '9') {
+      d = c - '0' + 52;
+    } else if (c == '+') {
+      d = 62;
+    } else if (c == '/') {
+      d = 63;
+    } else {
+      break;  // Padding
+    }
+
+    val = (val << 6) + d;
+    bits += 6;
+    if (bits >= 0) {
+      out.push_back(char((val >> bits) & 0xFF));
+      bits -= 8;
+    }
+  }
+
+  return out;
+}
+
 inline void to_json(json& j, const FileMetadata::Partition& p) {
   j = json{{"part_id", p.part_id},
            {"node_id", p.agent_id},
-           {"filepath", p.filepath}};
+           {"filepath", p.filepath},
+           {"size", p.size}};
 }
 
 inline void from_json(const json& j, FileMetadata::Partition& p) {
   j.at("part_id").get_to(p.part_id);
   j.at("node_id").get_to(p.agent_id);
   j.at("filepath").get_to(p.filepath);
+  p.size = j.value("size", (uint64_t)0);
 }
 
 inline void to_json(json& j, const FileMetadata& m) {
@@ -60,6 +125,11 @@ inline void to_json(json& j, const FileMetadata& m) {
            {"gid", m.gid},
            {"perm_flags", m.perm_flags},
            {"partitions", m.partitions}};
+
+  if (m.is_inline) {
+    j["inline"] = true;
+    j["data"] = base64_encode(m.inline_data);
+  }
 }
 
 inline void from_json(const json& j, FileMetadata& m) {
@@ -81,6 +151,9 @@ inline void from_json(const json& j, FileMetadata& m) {
   // }
 
   j.at("partitions").get_to(m.partitions);
+
+  m.is_inline = j.value("inline", false);
+  if (m.is_inline) m.inline_data = base64_decode(j.at("data"));
 }
 
 struct User {
@@ -105,17 +178,56 @@ class FileExistsException : public std::exception {
   std::string m_filepath;
 };
 
+class NotADirectoryException : public std::exception {
+ public:
+  NotADirectoryException(const std::string& filepath) : m_filepath(filepath) {}
+  const char* what() const noexcept override { return "Not a directory"; }
+
+  std::string m_filepath;
+};
+
+class IsADirectoryException : public std::exception {
+ public:
+  IsADirectoryException(const std::string& filepath) : m_filepath(filepath) {}
+  const char* what() const noexcept override { return "Is a directory"; }
+
+  std::string m_filepath;
+};
+
+class AgentIdConflictException : public std::exception {
+ public:
+  AgentIdConflictException(uint16_t id) : m_id(id) {}
+  const char* what() const noexcept override {
+    return "Agent ID belongs to another agent";
+  }
+
+  uint16_t m_id;
+};
+
+class WrongShardException : public std::exception {
+ public:
+  WrongShardException(const std::string& filepath) : m_filepath(filepath) {}
+  const char* what() const noexcept override {
+    return "Path is owned by another CMMU shard";
+  }
+
+  std::string m_filepath;
+};
+
 class Agent {
  public:
-  Agent(uint16_t id, std::string address, uint16_t port)
+  Agent(uint16_t id, std::string address, uint16_t port,
+        uint16_t data_port = 0)
       : m_id(id),
         m_address(address),
         m_port(port),
+        m_data_port(data_port),
         m_conn(httplib::Client(address, port)) {}
 
  public:
   uint16_t m_id;
   std::string m_address;
   uint16_t m_port;
+  uint16_t m_data_port;  // Binary data plane, 0 if the agent has none
   httplib::Client m_conn;
 };
@@ -0,0 +1,142 @@
+/**
+ * Partition transfer benchmark
+ *
+ * Moves partitions to and from an in-process server over the binary data
+ * plane and over HTTP, where writes are multipart bodies like /internal/write
+ * used to take. Every client thread transfers partitions back to back, the
+ * data plane clients all share one connection. Reports throughput and the CPU
+ * time of the whole process (clients and server) per GB moved.
+ *
+ * Usage: data_plane_bench [partition size in KB] [MB per run]
+ */
+#include <httplib.h>
+#include <sys/resource.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "data_plane.hpp"
+
+const uint16_t data_port = 19871;
+
+struct Result {
+  double gbps;
+  double cpu_per_gb;
+};
+
+double cpu_seconds() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+Result run(unsigned clients, size_t part_size, uint64_t total,
+           std::function<void(unsigned)> op) {
+  std::atomic<int64_t> remaining = total / part_size;
+  std::vector<std::thread> threads;
+
+  auto start = std::chrono::steady_clock::now();
+  double cpu_start = cpu_seconds();
+
+  for (unsigned i = 0; i < clients; i++) {
+    threads.emplace_back([&, i]() {
+      while (remaining.fetch_sub(1) > 0) op(i);
+    });
+  }
+  for (auto& t : threads) t.join();
+
+  double secs = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+  double gb = (double)(total / part_size * part_size) / (1 << 30);
+  return {gb / secs, (cpu_seconds() - cpu_start) / gb};
+}
+
+int main(int argc, char* argv[]) {
+  size_t part_size = (argc > 1 ? std::stoul(argv[1]) : 4096) * 1024;
+  uint64_t total = (argc > 2 ? std::stoull(argv[2]) : 4096) * 1024 * 1024;
+
+  auto content = std::make_shared<const std::string>(part_size, 'x');
+  const std::string name = "00000000-0000-0000-0000-000000000000";
+
+  // Servers drop writes and serve every read from the same buffer, so only
+  // the transfer itself is measured
+  DataPlaneServer data_server(
+      [&](DataFrame& req, DataPlaneServer::Respond respond) {
+        if (req.op == DataOp::Read) return respond(content, nullptr);
+        if (req.data.size() != part_size) {
+          throw std::runtime_error("Short write");
+        }
+        respond(nullptr, nullptr);
+      });
+  if (!data_server.bind_to_port("127.0.0.1", data_port)) {
+    std::fprintf(stderr, "Cannot listen on port %u\n", data_port);
+    return 1;
+  }
+  std::thread data_thread([&]() { data_server.listen_after_bind(); });
+
+  httplib::Server http_server;
+  http_server.Post("/internal/write", [&](const httplib::Request& req,
+                                          httplib::Response& res) {
+    const auto& file = req.files.begin()->second;
+    res.status = file.content.size() == part_size ? 201 : 400;
+  });
+  http_server.Post("/internal/read", [&](const httplib::Request& req,
+                                         httplib::Response& res) {
+    res.set_content(*content, "application/octet-stream");
+  });
+  int http_port = http_server.bind_to_any_port("127.0.0.1");
+  std::thread http_thread([&]() { http_server.listen_after_bind(); });
+
+  std::printf("%-8s %-12s %-8s %10s %12s\n", "op", "transport", "clients",
+              "GB/s", "CPU s/GB");
+
+  DataPlaneClient data_client("127.0.0.1", data_port);
+  for (unsigned clients = 1; clients <= 16; clients *= 4) {
+    std::vector<std::unique_ptr<httplib::Client>> http_clients;
+    for (unsigned i = 0; i < clients; i++) {
+      http_clients.push_back(
+          std::make_unique<httplib::Client>("127.0.0.1", http_port));
+      http_clients.back()->set_keep_alive(true);
+    }
+
+    auto r = run(clients, part_size, total, [&](unsigned) {
+      data_client.write(name, content->data(), content->size());
+    });
+    std::printf("%-8s %-12s %-8u %10.2f %12.2f\n", "write", "data plane",
+                clients, r.gbps, r.cpu_per_gb);
+
+    r = run(clients, part_size, total, [&](unsigned i) {
+      httplib::MultipartFormDataItems items = {
+          {"name", *content, name, "application/octet-stream"}};
+      http_clients[i]->Post("/internal/write", items);
+    });
+    std::printf("%-8s %-12s %-8u %10.2f %12.2f\n", "write", "multipart",
+                clients, r.gbps, r.cpu_per_gb);
+
+    r = run(clients, part_size, total,
+            [&](unsigned) { data_client.read(name); });
+    std::printf("%-8s %-12s %-8u %10.2f %12.2f\n", "read", "data plane",
+                clients, r.gbps, r.cpu_per_gb);
+
+    r = run(clients, part_size, total, [&](unsigned i) {
+      http_clients[i]->Post("/internal/read", "{}", "application/json");
+    });
+    std::printf("%-8s %-12s %-8u %10.2f %12.2f\n", "read", "http", clients,
+                r.gbps, r.cpu_per_gb);
+  }
+
+  http_server.stop();
+  http_thread.join();
+  data_server.stop();
+  data_thread.join();
+
+  return 0;
+}
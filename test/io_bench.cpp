@@ -0,0 +1,162 @@
+/**
+ * Partition read/write benchmark
+ *
+ * Compares the std::fstream path the agent used to have with the I/O engine
+ * at queue depths 1 to 64. Every client thread reads (or writes) random
+ * partitions back to back, like concurrent /internal/read requests. The
+ * "async" rows use a single thread that keeps `depth` transfers in flight
+ * through the completion callbacks, like the data plane does.
+ *
+ * Usage: io_bench <directory> [partition size in KB] [--direct]
+ */
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "io_engine.hpp"
+
+const int num_files = 256;
+const auto duration = std::chrono::seconds(3);
+
+struct Result {
+  double iops;
+  double mbps;
+};
+
+Result run(unsigned clients, size_t part_size,
+           std::function<void(int)> op) {
+  std::atomic<uint64_t> ops = 0;
+  std::atomic<bool> stop = false;
+  std::vector<std::thread> threads;
+
+  for (unsigned i = 0; i < clients; i++) {
+    threads.emplace_back([&, i]() {
+      std::mt19937 rng(i);
+      while (!stop) {
+        op(rng() % num_files);
+        ops++;
+      }
+    });
+  }
+
+  std::this_thread::sleep_for(duration);
+  stop = true;
+  for (auto& t : threads) t.join();
+
+  double secs = std::chrono::duration<double>(duration).count();
+  return {ops / secs, ops * part_size / secs / (1024 * 1024)};
+}
+
+/**
+ * Run `op` from one thread with at most `depth` of them in flight, `op` calls
+ * its argument when it completes
+ */
+Result run_async(unsigned depth, size_t part_size,
+                 std::function<void(int, std::function<void()>)> op) {
+  std::mutex mutex;
+  std::condition_variable cond;
+  unsigned inflight = 0;
+  uint64_t ops = 0;
+  std::mt19937 rng(0);
+
+  auto start = std::chrono::steady_clock::now();
+  while (std::chrono::steady_clock::now() - start < duration) {
+    {
+      std::unique_lock lock(mutex);
+      cond.wait(lock, [&]() { return inflight < depth; });
+      inflight++;
+    }
+    op(rng() % num_files, [&]() {
+      std::lock_guard lock(mutex);
+      inflight--;
+      ops++;
+      cond.notify_one();
+    });
+  }
+
+  std::unique_lock lock(mutex);
+  cond.wait(lock, [&]() { return inflight == 0; });
+  double secs = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+  return {ops / secs, ops * part_size / secs / (1024 * 1024)};
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    std::fprintf(stderr, "Usage: %s <directory> [partition size in KB] "
+                 "[--direct]\n", argv[0]);
+    return 1;
+  }
+
+  std::filesystem::path dir(argv[1]);
+  size_t part_size = (argc > 2 ? std::stoul(argv[2]) : 1024) * 1024;
+  bool direct = argc > 3 && std::string(argv[3]) == "--direct";
+
+  std::filesystem::create_directories(dir);
+  auto path = [&](int i) { return dir / ("bench-" + std::to_string(i)); };
+
+  std::string content(part_size, 'x');
+  for (int i = 0; i < num_files; i++) {
+    std::ofstream f(path(i), std::ios::binary);
+    f.write(content.data(), content.size());
+  }
+
+  std::printf("%-8s %-16s %-6s %12s %12s\n", "op", "engine", "depth",
+              "IOPS", "MB/s");
+  auto print = [](const char* op, std::string engine, unsigned depth,
+                  Result r) {
+    std::printf("%-8s %-16s %-6u %12.0f %12.1f\n", op, engine.c_str(), depth,
+                r.iops, r.mbps);
+  };
+  auto content_ptr = std::make_shared<const std::string>(content);
+
+  for (unsigned depth = 1; depth <= 64; depth *= 2) {
+    auto stream = run(depth, part_size, [&](int i) {
+      std::ifstream f(path(i), std::ios::binary);
+      std::string data(part_size, 0);
+      f.read(data.data(), data.size());
+    });
+    print("read", "fstream", depth, stream);
+
+    auto io = make_io_engine(depth, direct, 0);
+    auto read = run(depth, part_size, [&](int i) { io->read_file(path(i)); });
+    print("read", io->name(), depth, read);
+
+    read = run_async(depth, part_size, [&](int i, std::function<void()> done) {
+      io->read_file_async(path(i), [done](std::string, std::exception_ptr) {
+        done();
+      });
+    });
+    print("read", std::string(io->name()) + " async", depth, read);
+
+    stream = run(depth, part_size, [&](int i) {
+      std::ofstream f(path(i), std::ios::binary);
+      f.write(content.data(), content.size());
+    });
+    print("write", "fstream", depth, stream);
+
+    auto write = run(depth, part_size,
+                     [&](int i) { io->write_file(path(i), content); });
+    print("write", io->name(), depth, write);
+
+    write = run_async(depth, part_size, [&](int i, std::function<void()> done) {
+      io->write_file_async(path(i), content_ptr,
+                           [done](std::exception_ptr) { done(); });
+    });
+    print("write", std::string(io->name()) + " async", depth, write);
+  }
+
+  for (int i = 0; i < num_files; i++) std::filesystem::remove(path(i));
+
+  return 0;
+}
@@ -0,0 +1,141 @@
+/**
+ * CMMU metadata memory and lookup benchmark
+ *
+ * Fills a MetadataStore with N files of P partitions each, spread over
+ * directories of 1000 files, then reports the resident memory per file and
+ * the cost of random lookups. The memory includes the namespace tree, i.e.
+ * the directory entries and their names. With --legacy the same files are also
+ * stored the way the CMMU used to: an unordered_map<inode, FileMetadata> with
+ * full paths and directory entries owning their names. Both layouts run the
+ * same lookups.
+ *
+ * Usage: metadata_bench [files] [partitions per file] [--legacy]
+ */
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <random>
+#include <string>
+#include <unordered_map>
+
+#include "metadata_store.hpp"
+
+const uint64_t num_lookups = 1000000;
+const uint64_t files_per_dir = 1000;
+
+uint64_t rss_bytes() {
+  uint64_t pages = 0, resident = 0;
+  std::ifstream statm("/proc/self/statm");
+  statm >> pages >> resident;
+  return resident * 4096;
+}
+
+FileMetadata make_file(uint64_t inode, uint64_t num_parts,
+                       std::mt19937_64& rng) {
+  FileMetadata m;
+  m.filepath = "/data/dir-" + std::to_string(inode / files_per_dir) +
+               "/file-" + std::to_string(inode) + ".json";
+  m.inode_number = inode;
+  m.filetype = FileType::File;
+  m.size = num_parts * 1024 * 1024;
+  m.uid = 0;
+  m.gid = 0;
+  m.perm_flags = 0x7770;
+
+  for (uint64_t p = 0; p < num_parts; p++) {
+    PartitionId id;
+    for (auto& b : id.bytes) b = rng();
+    m.partitions.push_back({p, (uint16_t)(rng() % 16 + 1), id.to_string(),
+                            1024 * 1024});
+  }
+
+  return m;
+}
+
+template <class F>
+double ns_per_lookup(uint64_t files, F lookup) {
+  std::mt19937_64 rng(42);
+  uint64_t checksum = 0;
+
+  auto start = std::chrono::steady_clock::now();
+  for (uint64_t i = 0; i < num_lookups; i++) {
+    checksum += lookup(rng() % files + 1);
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  if (checksum == 42) std::printf(" ");  // Keep the lookups alive
+  return std::chrono::duration<double, std::nano>(end - start).count() /
+         num_lookups;
+}
+
+int main(int argc, char* argv[]) {
+  uint64_t files = argc > 1 ? std::stoull(argv[1]) : 1000000;
+  uint64_t parts = argc > 2 ? std::stoull(argv[2]) : 4;
+  bool legacy = argc > 3 && std::string(argv[3]) == "--legacy";
+
+  std::printf("%llu files, %llu partitions each\n", (unsigned long long)files,
+              (unsigned long long)parts);
+
+  {
+    std::mt19937_64 rng(1);
+    uint64_t before = rss_bytes();
+    MetadataStore store;
+    std::map<uint64_t, std::map<std::string_view, uint64_t>> dirs;
+    for (uint64_t i = 1; i <= files; i++) {
+      FileMetadata m = make_file(i, parts, rng);
+      auto name = m.filepath.substr(m.filepath.rfind('/') + 1);
+      dirs[i / files_per_dir][store.names().intern(name)] = i;
+      store.put(m);
+    }
+    uint64_t after = rss_bytes();
+
+    std::printf("compact: %8.1f bytes/file (RSS), %s\n",
+                (double)(after - before) / files,
+                store.memory_usage().dump().c_str());
+    std::printf("compact: %8.1f ns/lookup (attributes)\n",
+                ns_per_lookup(files, [&](uint64_t inode) {
+                  return store.get(inode, false).size;
+                }));
+    std::printf("compact: %8.1f ns/lookup (with partitions)\n",
+                ns_per_lookup(files, [&](uint64_t inode) {
+                  return store.get(inode).partitions.size();
+                }));
+  }
+
+  if (legacy) {
+    std::mt19937_64 rng(1);
+    uint64_t before = rss_bytes();
+    std::unordered_map<uint64_t, FileMetadata> db;
+    std::map<uint64_t, std::map<std::string, uint64_t>> dirs;
+    for (uint64_t i = 1; i <= files; i++) {
+      FileMetadata m = make_file(i, parts, rng);
+      dirs[i / files_per_dir][m.filepath.substr(m.filepath.rfind('/') + 1)] = i;
+      db[i] = std::move(m);
+    }
+    uint64_t after = rss_bytes();
+
+    std::printf("legacy:  %8.1f bytes/file (RSS)\n",
+                (double)(after - before) / files);
+    // Copies, like the old /stat
+    std::printf("legacy:  %8.1f ns/lookup (attributes)\n",
+                ns_per_lookup(files, [&](uint64_t inode) {
+                  auto& m = db.at(inode);
+                  FileMetadata attrs;
+                  attrs.inode_number = m.inode_number;
+                  attrs.filetype = m.filetype;
+                  attrs.size = m.size;
+                  attrs.uid = m.uid;
+                  attrs.gid = m.gid;
+                  attrs.perm_flags = m.perm_flags;
+                  return attrs.size;
+                }));
+    std::printf("legacy:  %8.1f ns/lookup (with partitions)\n",
+                ns_per_lookup(files, [&](uint64_t inode) {
+                  FileMetadata m = db.at(inode);
+                  return m.partitions.size();
+                }));
+  }
+
+  return 0;
+}
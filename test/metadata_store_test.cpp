@@ -0,0 +1,147 @@
+#include <gtest/gtest.h>
+
+#include "metadata_store.hpp"
+
+const std::string uuid = "0123abcd-4567-89ef-0123-456789abcdef";
+
+FileMetadata make_file(uint64_t inode, uint64_t num_parts) {
+  FileMetadata m;
+  m.inode_number = inode;
+  m.filetype = FileType::File;
+  m.size = num_parts * 100;
+  m.uid = 1000;
+  m.gid = 100;
+  m.perm_flags = 0x7770;
+
+  for (uint64_t p = 0; p < num_parts; p++) {
+    PartitionId id{};
+    id.bytes[0] = inode;
+    id.bytes[15] = p;
+    m.partitions.push_back({p, (uint16_t)(p % 2 + 1), id.to_string(), 100});
+  }
+
+  return m;
+}
+
+TEST(PartitionIdTest, RoundTrip) {
+  EXPECT_EQ(PartitionId::from_string(uuid).to_string(), uuid);
+}
+
+TEST(PartitionIdTest, AcceptsUpperCase) {
+  auto upper = "0123ABCD-4567-89EF-0123-456789ABCDEF";
+  EXPECT_EQ(PartitionId::from_string(upper).to_string(), uuid);
+}
+
+TEST(PartitionIdTest, RejectsInvalid) {
+  std::vector<std::string> invalid = {
+      "", "..", "../etc/passwd", uuid.substr(1), uuid + "0",
+      "0123abcd4567-89ef-0123-456789abcdef0",
+      "0123abcd-4567-89ef-0123-456789abcdeg",
+      "0123abcd/4567-89ef-0123-456789abcdef"};
+  for (auto& bad : invalid) {
+    EXPECT_THROW(PartitionId::from_string(bad), std::invalid_argument) << bad;
+  }
+}
+
+TEST(MetadataStoreTest, PutGet) {
+  MetadataStore store;
+  store.put(make_file(2, 3));
+
+  EXPECT_TRUE(store.contains(2));
+  EXPECT_FALSE(store.contains(1));
+  EXPECT_FALSE(store.contains(3));
+  EXPECT_THROW(store.get(3), std::out_of_range);
+
+  auto expected = make_file(2, 3);
+  auto m = store.get(2);
+  EXPECT_EQ(m.inode_number, 2);
+  EXPECT_EQ(m.size, expected.size);
+  EXPECT_EQ(m.uid, expected.uid);
+  EXPECT_EQ(m.gid, expected.gid);
+  EXPECT_EQ(m.perm_flags, expected.perm_flags);
+  ASSERT_EQ(m.partitions.size(), 3);
+  for (size_t i = 0; i < 3; i++) {
+    EXPECT_EQ(m.partitions[i].part_id, expected.partitions[i].part_id);
+    EXPECT_EQ(m.partitions[i].agent_id, expected.partitions[i].agent_id);
+    EXPECT_EQ(m.partitions[i].filepath, expected.partitions[i].filepath);
+    EXPECT_EQ(m.partitions[i].size, expected.partitions[i].size);
+  }
+
+  EXPECT_TRUE(store.get(2, false).partitions.empty());
+}
+
+TEST(MetadataStoreTest, PutReplacesPartitions) {
+  MetadataStore store;
+  store.put(make_file(1, 4));
+  store.put(make_file(1, 1));
+
+  EXPECT_EQ(store.get(1).partitions.size(), 1);
+  EXPECT_EQ(store.agent_bytes().at(1), 100);
+  EXPECT_EQ(store.agent_bytes().at(2), 0);
+}
+
+TEST(MetadataStoreTest, MovePartition) {
+  MetadataStore store;
+  store.put(make_file(1, 2));
+  auto part = store.get(1).partitions[1];
+  auto id = PartitionId::from_string(part.filepath);
+  ASSERT_EQ(part.agent_id, 2);
+
+  EXPECT_TRUE(store.move_partition(1, part.part_id, id, 2, 3));
+  EXPECT_EQ(store.get(1).partitions[1].agent_id, 3);
+  EXPECT_EQ(store.agent_bytes().at(2), 0);
+  EXPECT_EQ(store.agent_bytes().at(3), 100);
+
+  // The partition is no longer on agent 2, e.g. it was moved concurrently
+  EXPECT_FALSE(store.move_partition(1, part.part_id, id, 2, 4));
+  EXPECT_FALSE(store.move_partition(5, part.part_id, id, 3, 4));
+  EXPECT_EQ(store.get(1).partitions[1].agent_id, 3);
+}
+
+TEST(PartitionArenaTest, ReusesRunsWithinSizeClass) {
+  PartitionArena arena;
+  auto run = arena.allocate(3);
+  arena.release(run);
+  EXPECT_EQ(arena.free_slots(), 4);
+
+  auto reused = arena.allocate(4);
+  EXPECT_EQ(reused.block, run.block);
+  EXPECT_EQ(reused.offset, run.offset);
+  EXPECT_EQ(reused.count, 4);
+  EXPECT_EQ(arena.free_slots(), 0);
+}
+
+TEST(PartitionArenaTest, ResizeKeepsRunWithinSizeClass) {
+  PartitionArena arena;
+  auto run = arena.allocate(5);
+  auto resized = arena.resize(run, 8);
+  EXPECT_EQ(resized.offset, run.offset);
+  EXPECT_EQ(resized.count, 8);
+
+  auto moved = arena.resize(resized, 9);
+  EXPECT_NE(moved.offset, run.offset);
+  EXPECT_EQ(arena.free_slots(), 8);
+}
+
+TEST(PartitionArenaTest, RunsDoNotOverlap) {
+  PartitionArena arena;
+  std::vector<PartitionArena::Run> runs;
+  for (uint32_t count = 1; count < 2000; count += 7) {
+    runs.push_back(arena.allocate(count));
+  }
+  for (size_t i = 0; i < runs.size(); i += 2) arena.release(runs[i]);
+  for (size_t i = 0; i < runs.size(); i += 2) {
+    runs[i] = arena.allocate(runs[i].count);
+  }
+
+  for (size_t i = 0; i < runs.size(); i++) {
+    auto parts = arena.get(runs[i]);
+    for (uint32_t j = 0; j < runs[i].count; j++) parts[j].part_id = i;
+  }
+  for (size_t i = 0; i < runs.size(); i++) {
+    auto parts = arena.get(runs[i]);
+    for (uint32_t j = 0; j < runs[i].count; j++) {
+      ASSERT_EQ(parts[j].part_id, i);
+    }
+  }
+}
@@ -0,0 +1,114 @@
+#include <gtest/gtest.h>
+
+#include "partition_cache.hpp"
+
+// Every shard holds 10 partitions of 100 bytes, its small FIFO one
+const uint64_t shard_capacity = 1000;
+const uint64_t capacity = shard_capacity * PartitionCache::NUM_SHARDS;
+
+PartitionCache::Data make_data(size_t size) {
+  return std::make_shared<const std::string>(size, 'x');
+}
+
+/**
+ * `count` keys that land in the same shard
+ */
+std::vector<std::string> same_shard_keys(size_t count) {
+  auto shard = [](const std::string& key) {
+    return std::hash<std::string>{}(key) % PartitionCache::NUM_SHARDS;
+  };
+
+  std::vector<std::string> keys;
+  for (size_t i = 0; keys.size() < count; i++) {
+    auto key = "part-" + std::to_string(i);
+    if (keys.empty() || shard(key) == shard(keys[0])) keys.push_back(key);
+  }
+  return keys;
+}
+
+TEST(PartitionCacheTest, GetPut) {
+  PartitionCache cache(capacity);
+  EXPECT_EQ(cache.get("a"), nullptr);
+
+  auto data = make_data(100);
+  cache.put("a", data);
+  EXPECT_EQ(cache.get("a"), data);
+
+  auto stats = cache.stats();
+  EXPECT_EQ(stats["hits"], 1);
+  EXPECT_EQ(stats["misses"], 1);
+  EXPECT_EQ(stats["size"], 100);
+}
+
+TEST(PartitionCacheTest, PromotesReadEntriesToMain) {
+  PartitionCache cache(capacity);
+  auto keys = same_shard_keys(11);
+
+  cache.put(keys[0], make_data(100));
+  cache.get(keys[0]);
+  cache.get(keys[0]);
+  for (size_t i = 1; i < 11; i++) cache.put(keys[i], make_data(100));
+
+  // The shard overflowed once: keys[0] moved to the main FIFO instead of
+  // being evicted, the next oldest unread entry went instead
+  EXPECT_NE(cache.get(keys[0]), nullptr);
+  EXPECT_EQ(cache.get(keys[1]), nullptr);
+  EXPECT_NE(cache.get(keys[2]), nullptr);
+}
+
+TEST(PartitionCacheTest, GhostsGoStraightToMain) {
+  PartitionCache cache(capacity);
+  auto keys = same_shard_keys(40);
+
+  for (size_t i = 0; i < 11; i++) cache.put(keys[i], make_data(100));
+  ASSERT_EQ(cache.get(keys[0]), nullptr);
+
+  // keys[0] is remembered as a ghost and comes back in the main FIFO, which
+  // a scan of new partitions only churning the small FIFO does not touch
+  cache.put(keys[0], make_data(100));
+  for (size_t i = 11; i < 40; i++) cache.put(keys[i], make_data(100));
+  EXPECT_NE(cache.get(keys[0]), nullptr);
+  EXPECT_EQ(cache.get(keys[11]), nullptr);
+}
+
+TEST(PartitionCacheTest, MainGivesReadEntriesAnotherRound) {
+  PartitionCache cache(capacity);
+  auto keys = same_shard_keys(12);
+  auto& old_main = keys[0];
+  auto& new_main = keys[1];
+  auto& big = keys[11];
+
+  for (auto& key : {old_main, new_main}) {
+    cache.put(key, make_data(100));
+    cache.get(key);
+    cache.get(key);
+  }
+  for (size_t i = 2; i < 11; i++) cache.put(keys[i], make_data(100));
+
+  // Both are in the main FIFO now, old_main is the oldest but read again
+  cache.get(old_main);
+
+  // Makes room from the small FIFO first, then from the main one
+  cache.put(big, make_data(800));
+  ASSERT_NE(cache.get(big), nullptr);
+  EXPECT_NE(cache.get(old_main), nullptr);
+  EXPECT_EQ(cache.get(new_main), nullptr);
+}
+
+TEST(PartitionCacheTest, StaysWithinByteBudget) {
+  PartitionCache cache(capacity);
+
+  // A partition larger than a shard is never cached
+  cache.put("too-big", make_data(shard_capacity + 1));
+  EXPECT_EQ(cache.get("too-big"), nullptr);
+  cache.put("fits", make_data(shard_capacity));
+  EXPECT_NE(cache.get("fits"), nullptr);
+
+  for (size_t i = 0; i < 2000; i++) {
+    auto key = "part-" + std::to_string(i);
+    cache.put(key, make_data(i * 37 % shard_capacity + 1));
+    if (i % 3 == 0) cache.get(key);
+    ASSERT_LE(cache.stats()["size"], capacity);
+  }
+  EXPECT_EQ(cache.stats()["capacity"], capacity);
+}
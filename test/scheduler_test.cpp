@@ -0,0 +1,143 @@
+#include <gtest/gtest.h>
+
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "scheduler.hpp"
+
+using namespace std::chrono_literals;
+
+RequestScheduler make_scheduler(unsigned max_running,
+                                std::array<unsigned, 4> limits,
+                                size_t max_queued = 16,
+                                size_t max_queued_lower = 16,
+                                std::chrono::milliseconds max_delay = 2000ms) {
+  return RequestScheduler(max_running, limits, max_queued, max_queued_lower,
+                          max_delay);
+}
+
+/**
+ * Wait until `count` requests are queued in `name`
+ */
+void wait_queued(const RequestScheduler& scheduler, const char* name,
+                 size_t count) {
+  while (scheduler.stats()[name]["queued"] != count) {
+    std::this_thread::sleep_for(1ms);
+  }
+}
+
+TEST(RequestSchedulerTest, RejectsZeroLimits) {
+  EXPECT_THROW(make_scheduler(0, {1, 1, 1, 1}), std::invalid_argument);
+  EXPECT_THROW(make_scheduler(1, {1, 0, 1, 1}), std::invalid_argument);
+  EXPECT_THROW(make_scheduler(1, {1, 1, 1, 0}), std::invalid_argument);
+}
+
+TEST(RequestSchedulerTest, InteractiveGoesFirst) {
+  auto scheduler = make_scheduler(1, {1, 1, 1, 1});
+  auto running = scheduler.admit(Priority::Interactive);
+  ASSERT_TRUE(running);
+
+  std::mutex mutex;
+  std::vector<Priority> order;
+  auto request = [&](Priority priority) {
+    auto ticket = scheduler.admit(priority);
+    ASSERT_TRUE(ticket);
+    std::lock_guard lock(mutex);
+    order.push_back(priority);
+  };
+
+  std::thread background(request, Priority::Background);
+  wait_queued(scheduler, "background", 1);
+  std::thread bulk(request, Priority::Bulk);
+  wait_queued(scheduler, "bulk", 1);
+  std::thread interactive(request, Priority::Interactive);
+  wait_queued(scheduler, "interactive", 1);
+
+  running.reset();
+  background.join();
+  bulk.join();
+  interactive.join();
+
+  std::vector<Priority> expected = {Priority::Interactive, Priority::Bulk,
+                                    Priority::Background};
+  EXPECT_EQ(order, expected);
+}
+
+TEST(RequestSchedulerTest, ClassLimit) {
+  auto scheduler = make_scheduler(4, {4, 1, 1, 1});
+  auto bulk = scheduler.try_admit(Priority::Bulk);
+  ASSERT_TRUE(bulk);
+  EXPECT_FALSE(scheduler.try_admit(Priority::Bulk));
+  EXPECT_TRUE(scheduler.try_admit(Priority::Interactive));
+
+  bulk.reset();
+  EXPECT_TRUE(scheduler.try_admit(Priority::Bulk));
+}
+
+TEST(RequestSchedulerTest, PeerSlotsAreOnTop) {
+  auto scheduler = make_scheduler(1, {1, 1, 1, 2});
+  auto running = scheduler.admit(Priority::Interactive);
+  ASSERT_TRUE(running);
+  EXPECT_FALSE(scheduler.try_admit(Priority::Interactive));
+
+  // Peer transfers still run while every other slot is taken
+  auto peer1 = scheduler.try_admit(Priority::Peer);
+  auto peer2 = scheduler.try_admit(Priority::Peer);
+  EXPECT_TRUE(peer1);
+  EXPECT_TRUE(peer2);
+  EXPECT_FALSE(scheduler.try_admit(Priority::Peer));
+
+  // And they do not take slots from the other classes
+  running.reset();
+  EXPECT_TRUE(scheduler.try_admit(Priority::Interactive));
+  EXPECT_EQ(scheduler.stats()["peer"]["shed"], 1);
+}
+
+TEST(RequestSchedulerTest, ShedsOnTimeout) {
+  auto scheduler = make_scheduler(1, {1, 1, 1, 1}, 16, 16, 20ms);
+  auto running = scheduler.admit(Priority::Interactive);
+
+  auto start = std::chrono::steady_clock::now();
+  EXPECT_FALSE(scheduler.admit(Priority::Interactive));
+  EXPECT_GE(std::chrono::steady_clock::now() - start, 20ms);
+
+  auto stats = scheduler.stats()["interactive"];
+  EXPECT_EQ(stats["shed"], 1);
+  EXPECT_EQ(stats["queued"], 0);
+}
+
+TEST(RequestSchedulerTest, ShedsWhenClassQueueIsFull) {
+  auto scheduler = make_scheduler(1, {1, 1, 1, 1}, 0);
+  auto running = scheduler.admit(Priority::Interactive);
+
+  auto start = std::chrono::steady_clock::now();
+  EXPECT_FALSE(scheduler.admit(Priority::Interactive));
+  EXPECT_LT(std::chrono::steady_clock::now() - start, 1000ms);
+}
+
+TEST(RequestSchedulerTest, BoundsWaitingBelowInteractive) {
+  auto scheduler = make_scheduler(1, {1, 1, 1, 1}, 16, 1, 200ms);
+  auto running = scheduler.admit(Priority::Interactive);
+
+  std::thread bulk([&]() { EXPECT_FALSE(scheduler.admit(Priority::Bulk)); });
+  wait_queued(scheduler, "bulk", 1);
+
+  // The lower classes are full, shed at once
+  auto start = std::chrono::steady_clock::now();
+  EXPECT_FALSE(scheduler.admit(Priority::Background));
+  EXPECT_FALSE(scheduler.admit(Priority::Bulk));
+  EXPECT_LT(std::chrono::steady_clock::now() - start, 100ms);
+
+  // Reads still wait for a slot, and take it before the waiting Bulk
+  std::shared_ptr<RequestScheduler::Ticket> read;
+  std::thread interactive([&]() {
+    read = scheduler.admit(Priority::Interactive);
+  });
+  wait_queued(scheduler, "interactive", 1);
+  running.reset();
+
+  interactive.join();
+  EXPECT_TRUE(read);
+  bulk.join();
+}